@@ -0,0 +1,473 @@
+#include "async.hpp"
+
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+// Lines readLine() hands out back to back, without the socket ever making
+// it wait, before it lets the rest of the loop have a turn
+const static unsigned int MAX_LINES_WITHOUT_WAIT = 64;
+
+IoScheduler ioScheduler;
+BlockingPool blockingPool;
+
+static thread_local EventLoop *currentLoop = nullptr;
+
+// ***************************************************************************
+// * EventLoop
+// ***************************************************************************
+EventLoop::EventLoop() : running(true), timerSeq(0)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    // The wake fd is the only one registered with a null pointer
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+}
+
+EventLoop::~EventLoop()
+{
+    ::close(wakefd);
+    ::close(epfd);
+}
+
+EventLoop *EventLoop::current() { return currentLoop; }
+
+void EventLoop::run()
+{
+    const static int MAXEVENTS = 64;
+    struct epoll_event events[MAXEVENTS];
+
+    currentLoop = this;
+    while (running) {
+        int timeout = -1;
+        if (!timers.empty()) {
+            auto wait = chrono::duration_cast<chrono::milliseconds>(timers.begin()->when - chrono::steady_clock::now());
+            timeout = wait.count() < 0 ? 0 : (int)wait.count() + 1;
+        }
+
+        int count = epoll_wait(epfd, events, MAXEVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == nullptr) {
+                uint64_t value;
+                while (read(wakefd, &value, sizeof(value)) > 0) {
+                }
+                continue;
+            }
+            coroutine_handle<>::from_address(events[i].data.ptr).resume();
+        }
+
+        fireTimers();
+        drainPosted();
+    }
+    currentLoop = nullptr;
+}
+
+void EventLoop::stop()
+{
+    running = false;
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+void EventLoop::post(coroutine_handle<> h)
+{
+    {
+        lock_guard<mutex> guard(postLock);
+        posted.push_back(h);
+    }
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+void EventLoop::drainPosted()
+{
+    vector<coroutine_handle<>> ready;
+    {
+        lock_guard<mutex> guard(postLock);
+        ready.swap(posted);
+    }
+    for (auto h : ready) {
+        h.resume();
+    }
+}
+
+void EventLoop::watch(int fd, uint32_t events, coroutine_handle<> h)
+{
+    // One-shot, so the fd is disarmed again as soon as it fires and the
+    // coroutine that gets resumed owns it until it waits again.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = h.address();
+
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT) {
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void EventLoop::forget(int fd) { epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr); }
+
+EventLoop::Timer EventLoop::addTimer(chrono::steady_clock::time_point when, coroutine_handle<> h)
+{
+    Timer timer{when, timerSeq++, h};
+    timers.insert(timer);
+    return timer;
+}
+
+bool EventLoop::cancelTimer(Timer const &timer) { return timers.erase(timer) > 0; }
+
+void EventLoop::fireTimers()
+{
+    auto now = chrono::steady_clock::now();
+    while (!timers.empty() && timers.begin()->when <= now) {
+        auto h = timers.begin()->handle;
+        timers.erase(timers.begin());
+        h.resume();
+    }
+}
+
+// ***************************************************************************
+// * IoScheduler
+// ***************************************************************************
+void IoScheduler::start(unsigned int threadCount)
+{
+    if (threadCount == 0) {
+        threadCount = 1;
+    }
+    for (unsigned int i = 0; i < threadCount; i++) {
+        loops.push_back(make_unique<EventLoop>());
+    }
+    for (auto &loop : loops) {
+        EventLoop *l = loop.get();
+        threads.emplace_back([l]() { l->run(); });
+    }
+}
+
+void IoScheduler::stop()
+{
+    for (auto &loop : loops) {
+        loop->stop();
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    threads.clear();
+}
+
+EventLoop &IoScheduler::next() { return *loops[nextLoop++ % loops.size()]; }
+
+// ***************************************************************************
+// * BlockingPool
+// ***************************************************************************
+void BlockingPool::start(unsigned int threadCount)
+{
+    for (unsigned int i = 0; i < threadCount; i++) {
+        threads.emplace_back([this]() {
+            while (true) {
+                function<void()> job;
+                {
+                    unique_lock<mutex> guard(lock);
+                    ready.wait(guard, [this]() { return stopping || !jobs.empty(); });
+                    if (jobs.empty()) {
+                        return;
+                    }
+                    job = move(jobs.front());
+                    jobs.pop_front();
+                }
+                job();
+            }
+        });
+    }
+}
+
+void BlockingPool::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+    threads.clear();
+}
+
+void BlockingPool::submit(function<void()> job)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        jobs.push_back(move(job));
+    }
+    ready.notify_one();
+}
+
+// ***************************************************************************
+// * spawn()
+// *  A fire-and-forget coroutine: it starts eagerly, hops onto the target
+// *  loop, and frees itself when the task it is carrying returns.
+// ***************************************************************************
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+static Detached runDetached(EventLoop *loop, Task<void> task)
+{
+    co_await resumeOn(*loop);
+    co_await task;
+}
+
+void spawn(EventLoop &loop, Task<void> task) { runDetached(&loop, move(task)); }
+
+// ***************************************************************************
+// * AsyncSocket
+// ***************************************************************************
+AsyncSocket::AsyncSocket(int fd) : sockfd(fd), inpos(0), ssl(nullptr), expired(false), overflowed(false), tlsFailed(false), linesSinceWait(0)
+{
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+AsyncSocket::~AsyncSocket() { close(); }
+
+void AsyncSocket::close()
+{
+    if (ssl != nullptr) {
+        // Best effort close_notify, we won't wait around for the reply
+        if (!tlsFailed) {
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        ssl = nullptr;
+    }
+    if (sockfd >= 0) {
+        if (EventLoop::current() != nullptr) {
+            EventLoop::current()->forget(sockfd);
+        }
+        ::close(sockfd);
+        sockfd = -1;
+    }
+}
+
+Task<bool> AsyncSocket::waitFor(uint32_t events, chrono::steady_clock::time_point deadline)
+{
+    bool ready = co_await DeadlineAwaiter{sockfd, events, deadline};
+    linesSinceWait = 0;
+    if (!ready) {
+        expired = true;
+        co_return false;
+    }
+    co_return true;
+}
+
+Task<bool> AsyncSocket::waitForTls(int result, chrono::steady_clock::time_point deadline)
+{
+    switch (SSL_get_error(ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+        co_return co_await waitFor(EPOLLIN, deadline);
+    case SSL_ERROR_WANT_WRITE:
+        co_return co_await waitFor(EPOLLOUT, deadline);
+    case SSL_ERROR_SYSCALL:
+    case SSL_ERROR_SSL:
+        // The connection is gone or garbled, a close_notify won't get through
+        tlsFailed = true;
+        co_return false;
+    default:
+        co_return false;
+    }
+}
+
+Task<ssize_t> AsyncSocket::readSome(char *buffer, size_t length, chrono::steady_clock::time_point deadline)
+{
+    while (ssl != nullptr) {
+        ERR_clear_error();
+        int len = SSL_read(ssl, buffer, length);
+        if (len > 0) {
+            co_return len;
+        }
+        if (SSL_get_error(ssl, len) == SSL_ERROR_ZERO_RETURN) {
+            co_return 0;
+        }
+        bool ready = co_await waitForTls(len, deadline);
+        if (!ready) {
+            co_return -1;
+        }
+    }
+
+    while (true) {
+        ssize_t len = recv(sockfd, buffer, length, 0);
+        if (len >= 0) {
+            co_return len;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return -1;
+        }
+        bool ready = co_await waitFor(EPOLLIN, deadline);
+        if (!ready) {
+            co_return -1;
+        }
+    }
+}
+
+Task<bool> AsyncSocket::readLine(string &line, size_t maxLength, chrono::milliseconds timeout)
+{
+    auto deadline = deadlineAfter(timeout);
+    char chunk[4096];
+
+    // A client that keeps the socket full would otherwise never give the
+    // loop back, and every other session on it would starve
+    if (++linesSinceWait > MAX_LINES_WITHOUT_WAIT && EventLoop::current() != nullptr) {
+        linesSinceWait = 0;
+        co_await YieldAwaiter{};
+    }
+
+    expired = false;
+    overflowed = false;
+    while (true) {
+        size_t newline = inbuf.find('\n', inpos);
+        if (newline != string::npos) {
+            size_t end = newline > inpos && inbuf[newline - 1] == '\r' ? newline - 1 : newline;
+            if (!overflowed) {
+                overflowed = end - inpos > maxLength;
+                line.assign(inbuf, inpos, min(end - inpos, maxLength));
+            }
+            inpos = newline + 1;
+
+            // Compact once the consumed prefix gets large
+            if (inpos > 4096 && inpos * 2 > inbuf.length()) {
+                inbuf.erase(0, inpos);
+                inpos = 0;
+            }
+            co_return true;
+        }
+
+        // Too long already (the +1 leaves room for a CR): keep the start,
+        // throw the rest away as it comes, up to the line end
+        if (inbuf.length() - inpos > maxLength + 1) {
+            if (!overflowed) {
+                line.assign(inbuf, inpos, maxLength);
+                overflowed = true;
+            }
+            inbuf.clear();
+            inpos = 0;
+        }
+
+        ssize_t len = co_await readSome(chunk, sizeof(chunk), deadline);
+        if (len <= 0) {
+            co_return false;
+        }
+        inbuf.append(chunk, len);
+    }
+}
+
+Task<bool> AsyncSocket::writeAll(string const &data, chrono::milliseconds timeout)
+{
+    auto deadline = deadlineAfter(timeout);
+    expired = false;
+
+    size_t offset = 0;
+    while (ssl != nullptr && offset < data.length()) {
+        // Without partial writes SSL_write is all or nothing, and a retry
+        // after WANT_* must pass the same arguments
+        ERR_clear_error();
+        int len = SSL_write(ssl, data.data() + offset, data.length() - offset);
+        if (len > 0) {
+            offset += len;
+            continue;
+        }
+        bool ready = co_await waitForTls(len, deadline);
+        if (!ready) {
+            co_return false;
+        }
+    }
+
+    while (offset < data.length()) {
+        ssize_t len = send(sockfd, data.data() + offset, data.length() - offset, MSG_NOSIGNAL);
+        if (len >= 0) {
+            offset += len;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return false;
+        }
+        bool ready = co_await waitFor(EPOLLOUT, deadline);
+        if (!ready) {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+Task<int> AsyncSocket::connectTo(struct sockaddr const *addr, socklen_t addrLength, chrono::milliseconds timeout)
+{
+    expired = false;
+    if (connect(sockfd, addr, addrLength) == 0) {
+        co_return 0;
+    }
+    if (errno != EINPROGRESS) {
+        co_return -1;
+    }
+
+    bool ready = co_await waitFor(EPOLLOUT, deadlineAfter(timeout));
+    if (!ready) {
+        errno = ETIMEDOUT;
+        co_return -1;
+    }
+
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 || error != 0) {
+        errno = error;
+        co_return -1;
+    }
+    co_return 0;
+}
+
+Task<bool> AsyncSocket::startTls(SSL *session, chrono::milliseconds timeout)
+{
+    auto deadline = deadlineAfter(timeout);
+    expired = false;
+    if (session == nullptr || ssl != nullptr) {
+        SSL_free(session);
+        co_return false;
+    }
+
+    ssl = session;
+    SSL_set_fd(ssl, sockfd);
+    inbuf.clear();
+    inpos = 0;
+
+    while (true) {
+        ERR_clear_error();
+        int result = SSL_do_handshake(ssl);
+        if (result == 1) {
+            co_return true;
+        }
+        bool ready = co_await waitForTls(result, deadline);
+        if (!ready) {
+            co_return false;
+        }
+    }
+}
@@ -0,0 +1,349 @@
+#ifndef __ASYNC_HPP_
+#define __ASYNC_HPP_
+
+#include <openssl/ssl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// ************************************************************************
+// * Task<T> is a lazily started coroutine. Nothing runs until somebody
+// * co_awaits it, and when it finishes it goes straight back to whoever
+// * was waiting on it. That lets the SMTP code stay written as a straight
+// * line of "send this, read that" while never blocking a thread.
+// *
+// * A task that finishes without ever suspending (a line that was already
+// * buffered) just returns to its awaiter, which carries on without
+// * suspending either. Only a task that really waited resumes its awaiter
+// * itself. So a client that keeps the socket full can't pile up stack
+// * frames, one per command, until the server falls over.
+// ************************************************************************
+template <typename T> class Task;
+
+struct TaskPromiseBase {
+    coroutine_handle<> continuation = noop_coroutine();
+    // Set by whichever of "task finished" and "awaiter suspended" comes
+    // second, which is then the one that has to resume the awaiter
+    atomic<bool> handoff{false};
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P> void await_suspend(coroutine_handle<P> h) noexcept
+        {
+            TaskPromiseBase &promise = h.promise();
+            if (promise.handoff.exchange(true, memory_order_acq_rel)) {
+                promise.continuation.resume();
+            }
+        }
+        void await_resume() noexcept {}
+    };
+
+    suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { terminate(); }
+};
+
+template <typename T> struct TaskPromise : TaskPromiseBase {
+    T value{};
+
+    Task<T> get_return_object();
+    void return_value(T v) { value = move(v); }
+    T result() { return move(value); }
+};
+
+template <> struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {}
+};
+
+template <typename T> class Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(coroutine_handle<promise_type> h) : handle(h) {}
+    Task(Task &&other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    Task(Task const &) = delete;
+    Task &operator=(Task const &) = delete;
+    ~Task()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    // Runs the task up to its first real suspension. Returns false, so
+    // the caller doesn't suspend at all, if it finished before that.
+    bool await_suspend(coroutine_handle<> caller) noexcept
+    {
+        handle.promise().continuation = caller;
+        handle.resume();
+        return !handle.promise().handoff.exchange(true, memory_order_acq_rel);
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    coroutine_handle<promise_type> handle;
+};
+
+template <typename T> Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// ************************************************************************
+// * EventLoop is one epoll instance driven by one thread. Coroutines park
+// * themselves on it while they wait for a socket, a timer, or for work to
+// * be handed back to them from another thread.
+// ************************************************************************
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    void run();
+    void stop();
+
+    // Thread-safe: resume h on this loop's thread
+    void post(coroutine_handle<> h);
+
+    // Loop thread only: resume h once fd reports one of events
+    void watch(int fd, uint32_t events, coroutine_handle<> h);
+    void forget(int fd);
+
+    struct Timer {
+        chrono::steady_clock::time_point when;
+        unsigned long seq;
+        coroutine_handle<> handle;
+        bool operator<(Timer const &other) const { return when != other.when ? when < other.when : seq < other.seq; }
+    };
+
+    // Loop thread only: resume h at (or shortly after) when. A timer that
+    // hasn't fired yet can be cancelled; cancelTimer() returns false if it
+    // is too late for that.
+    Timer addTimer(chrono::steady_clock::time_point when, coroutine_handle<> h);
+    bool cancelTimer(Timer const &timer);
+
+    static EventLoop *current();
+
+private:
+    void drainPosted();
+    void fireTimers();
+
+    int epfd;
+    int wakefd;
+    atomic<bool> running;
+    mutex postLock;
+    vector<coroutine_handle<>> posted;
+    set<Timer> timers;
+    unsigned long timerSeq;
+};
+
+// ************************************************************************
+// * IoScheduler owns a handful of EventLoops, one thread each, and hands
+// * new work out to them round-robin.
+// ************************************************************************
+class IoScheduler {
+public:
+    void start(unsigned int threadCount);
+    void stop();
+    EventLoop &next();
+
+private:
+    vector<unique_ptr<EventLoop>> loops;
+    vector<thread> threads;
+    atomic<unsigned int> nextLoop{0};
+};
+
+// ************************************************************************
+// * BlockingPool runs calls that have no non-blocking form (the resolver,
+// * mostly) on a few plain threads so they never stall an EventLoop.
+// ************************************************************************
+class BlockingPool {
+public:
+    void start(unsigned int threadCount);
+    void stop();
+    void submit(function<void()> job);
+
+private:
+    mutex lock;
+    condition_variable ready;
+    deque<function<void()>> jobs;
+    vector<thread> threads;
+    bool stopping = false;
+};
+
+extern IoScheduler ioScheduler;
+extern BlockingPool blockingPool;
+
+// ************************************************************************
+// * Awaitables
+// ************************************************************************
+struct FdAwaiter {
+    int fd;
+    uint32_t events;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) { EventLoop::current()->watch(fd, events, h); }
+    void await_resume() const noexcept {}
+};
+
+struct SleepAwaiter {
+    chrono::steady_clock::time_point when;
+
+    bool await_ready() const noexcept { return when <= chrono::steady_clock::now(); }
+    void await_suspend(coroutine_handle<> h) { EventLoop::current()->addTimer(when, h); }
+    void await_resume() const noexcept {}
+};
+
+struct ResumeOnAwaiter {
+    EventLoop &loop;
+
+    bool await_ready() const noexcept { return EventLoop::current() == &loop; }
+    void await_suspend(coroutine_handle<> h) { loop.post(h); }
+    void await_resume() const noexcept {}
+};
+
+// Goes to the back of the current loop's queue, behind whatever else is
+// ready to run
+struct YieldAwaiter {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) { EventLoop::current()->post(h); }
+    void await_resume() const noexcept {}
+};
+
+struct OffloadAwaiter {
+    function<void()> job;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h)
+    {
+        EventLoop *loop = EventLoop::current();
+        blockingPool.submit([this, loop, h]() {
+            job();
+            loop->post(h);
+        });
+    }
+    void await_resume() const noexcept {}
+};
+
+// Waits for fd like FdAwaiter, but gives up at deadline. co_await returns
+// false if it did.
+struct DeadlineAwaiter {
+    int fd;
+    uint32_t events;
+    chrono::steady_clock::time_point deadline;
+    EventLoop *loop = nullptr;
+    EventLoop::Timer timer{};
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h)
+    {
+        loop = EventLoop::current();
+        loop->watch(fd, events, h);
+        if (deadline != chrono::steady_clock::time_point::max()) {
+            timer = loop->addTimer(deadline, h);
+        }
+    }
+    bool await_resume()
+    {
+        // Whichever of the two didn't wake us is still armed: take it back
+        if (deadline == chrono::steady_clock::time_point::max() || loop->cancelTimer(timer)) {
+            return true;
+        }
+        loop->forget(fd);
+        return false;
+    }
+};
+
+// No deadline at all, for the timeout parameters below
+const static chrono::milliseconds NO_TIMEOUT = chrono::milliseconds::max();
+
+inline chrono::steady_clock::time_point deadlineAfter(chrono::milliseconds timeout)
+{
+    return timeout == NO_TIMEOUT ? chrono::steady_clock::time_point::max() : chrono::steady_clock::now() + timeout;
+}
+
+inline FdAwaiter waitReadable(int fd) { return FdAwaiter{fd, EPOLLIN}; }
+inline FdAwaiter waitWritable(int fd) { return FdAwaiter{fd, EPOLLOUT}; }
+inline SleepAwaiter sleepFor(chrono::milliseconds ms) { return SleepAwaiter{chrono::steady_clock::now() + ms}; }
+inline ResumeOnAwaiter resumeOn(EventLoop &loop) { return ResumeOnAwaiter{loop}; }
+inline OffloadAwaiter offload(function<void()> job) { return OffloadAwaiter{move(job)}; }
+
+// Start task on loop and let it run to completion on its own
+void spawn(EventLoop &loop, Task<void> task);
+
+// ************************************************************************
+// * AsyncSocket wraps a non-blocking fd with line-buffered reads and
+// * full writes that suspend instead of blocking. After startTls() the
+// * same calls go through OpenSSL. Every call takes a timeout; when it
+// * runs out the call fails and timedOut() says why.
+// ************************************************************************
+class AsyncSocket {
+public:
+    explicit AsyncSocket(int fd);
+    ~AsyncSocket();
+    AsyncSocket(AsyncSocket const &) = delete;
+    AsyncSocket &operator=(AsyncSocket const &) = delete;
+
+    int fd() const { return sockfd; }
+    void close();
+
+    // Reads one line and strips the CRLF. Returns false on EOF, error or
+    // timeout. A line longer than maxLength is read to its end all the
+    // same but comes back cut to maxLength, with lineTooLong() set.
+    Task<bool> readLine(string &line, size_t maxLength, chrono::milliseconds timeout = NO_TIMEOUT);
+    // Writes all of data. Returns false if the peer went away.
+    Task<bool> writeAll(string const &data, chrono::milliseconds timeout = NO_TIMEOUT);
+    // Non-blocking connect. Returns 0 on success, -1 on failure.
+    Task<int> connectTo(struct sockaddr const *addr, socklen_t addrLength, chrono::milliseconds timeout = NO_TIMEOUT);
+
+    // Takes ownership of ssl and runs the handshake. Anything the peer sent
+    // before it is thrown away (RFC 3207). Returns false on failure.
+    Task<bool> startTls(SSL *session, chrono::milliseconds timeout = NO_TIMEOUT);
+    SSL *tls() const { return ssl; }
+
+    // About the last call
+    bool timedOut() const { return expired; }
+    bool lineTooLong() const { return overflowed; }
+
+private:
+    Task<ssize_t> readSome(char *buffer, size_t length, chrono::steady_clock::time_point deadline);
+    // Suspends as OpenSSL asks. Returns false if the error was fatal.
+    Task<bool> waitForTls(int result, chrono::steady_clock::time_point deadline);
+    // Suspends until fd is ready. Returns false, and sets expired, at deadline.
+    Task<bool> waitFor(uint32_t events, chrono::steady_clock::time_point deadline);
+
+    int sockfd;
+    string inbuf;
+    size_t inpos;
+    SSL *ssl;
+    bool expired;
+    bool overflowed;
+    bool tlsFailed; // no SSL_shutdown() after SSL_ERROR_SYSCALL/SSL
+    unsigned int linesSinceWait; // see readLine()
+};
+
+#endif
@@ -0,0 +1,242 @@
+#include "delivery.hpp"
+#include "log.hpp"
+#include "relay.hpp"
+
+#include <algorithm>
+
+const static chrono::seconds DISPATCH_SWEEP_INTERVAL{1};
+
+DeliveryScheduler deliveryScheduler;
+
+void DeliveryScheduler::start(Transport t)
+{
+    transport = move(t);
+    lastPrune = chrono::steady_clock::now();
+    dispatcher = thread([this]() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_until(guard, dispatch(chrono::steady_clock::now()));
+        }
+    });
+}
+
+void DeliveryScheduler::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (dispatcher.joinable()) {
+        dispatcher.join();
+    }
+
+    lock_guard<mutex> guard(lock);
+    for (Domain *domain : ring) {
+        while (!domain->queued.empty()) {
+            complete(domain->queued.front(), RELAY_DEFERRED);
+            domain->queued.pop_front();
+        }
+        domain->inRing = false;
+    }
+    ring.clear();
+}
+
+DeliveryScheduler::Awaiter DeliveryScheduler::deliver(string const &reversePath, string const &forwardPath,
+                                                      string const &message)
+{
+    DeliveryJob job;
+    size_t atSignPos = forwardPath.find('@');
+    if (atSignPos != string::npos) {
+        job.domain = forwardPath.substr(atSignPos + 1);
+        transform(job.domain.begin(), job.domain.end(), job.domain.begin(), ::tolower);
+    }
+    job.reversePath = &reversePath;
+    job.forwardPath = &forwardPath;
+    job.message = &message;
+
+    return Awaiter{*this, move(job)};
+}
+
+void DeliveryScheduler::enqueue(DeliveryJob *job)
+{
+    lock_guard<mutex> guard(lock);
+    job->queued = chrono::steady_clock::now();
+
+    Domain &domain = domains[job->domain];
+    if (stopping || domain.queued.size() >= DOMAIN_MAX_QUEUED) {
+        if (logEnabled(LOG_WARN)) {
+            logRecord(LOG_WARN, "event=delivery_deferred domain=%s reason=queue_full queued=%zu",
+                      logValue(job->domain).c_str(), domain.queued.size());
+        }
+        complete(job, RELAY_DEFERRED);
+        return;
+    }
+
+    if (domain.name.empty()) {
+        domain.name = job->domain;
+    }
+    domain.queued.push_back(job);
+    schedule(domain);
+    wake.notify_one();
+}
+
+// Put the domain in the rotation if it isn't already
+void DeliveryScheduler::schedule(Domain &domain)
+{
+    if (!domain.inRing) {
+        domain.inRing = true;
+        ring.push_back(&domain);
+    }
+}
+
+void DeliveryScheduler::complete(DeliveryJob *job, int result)
+{
+    job->result = result;
+    job->loop->post(job->waiter);
+}
+
+Task<void> DeliveryScheduler::run(DeliveryJob *job)
+{
+    int result = co_await transport(*job->reversePath, *job->forwardPath, *job->message);
+    finished(job, result);
+}
+
+// ***************************************************************************
+// * finished()
+// *  Feedback from one delivery attempt. Success nudges the domain's limits
+// *  up; a 4xx or a refused connection halves them. Deliveries started
+// *  before the last cut don't cut again: everything in flight when the
+// *  remote got unhappy tends to hear about it at the same moment.
+// ***************************************************************************
+void DeliveryScheduler::finished(DeliveryJob *job, int result)
+{
+    lock_guard<mutex> guard(lock);
+    auto now = chrono::steady_clock::now();
+
+    Domain &domain = domains[job->domain];
+    domain.active--;
+    domain.lastUsed = now;
+    active--;
+
+    if (result == RELAY_OK) {
+        domain.concurrency = min(DOMAIN_MAX_CONCURRENCY, domain.concurrency + 1 / domain.concurrency);
+        domain.rate = min(DOMAIN_MAX_RATE, domain.rate * (1 + DOMAIN_RATE_GROWTH));
+        domain.backoff = chrono::milliseconds(0);
+    }
+    else if (relayTransient(result)) {
+        if (job->started >= domain.lastCut) {
+            // Not even one connection at a time goes through, leave it be
+            if (domain.concurrency <= 1) {
+                domain.backoff = min(DOMAIN_MAX_BACKOFF, max(DOMAIN_MIN_BACKOFF, domain.backoff * 2));
+                domain.nextStart = max(domain.nextStart, now + domain.backoff);
+            }
+            domain.concurrency = max(1.0, domain.concurrency / 2);
+            domain.rate = max(DOMAIN_MIN_RATE, domain.rate / 2);
+            domain.lastCut = now;
+            if (logEnabled(LOG_INFO)) {
+                logRecord(LOG_INFO,
+                          "event=domain_throttled domain=%s result=%d concurrency=%.1f rate=%.1f backoff_ms=%lld",
+                          logValue(domain.name).c_str(), result, domain.concurrency, domain.rate,
+                          (long long)domain.backoff.count());
+            }
+        }
+
+        if (++job->attempts < DELIVERY_MAX_ATTEMPTS && !stopping && now - job->queued < DELIVERY_QUEUE_TIMEOUT) {
+            domain.queued.push_front(job);
+            schedule(domain);
+            wake.notify_one();
+            return;
+        }
+    }
+
+    complete(job, result);
+    wake.notify_one();
+}
+
+// Fail whatever has waited too long. Queues are oldest first, near enough:
+// only retries jump the line, and they are older than what they jump.
+void DeliveryScheduler::expire(Domain &domain, chrono::steady_clock::time_point now)
+{
+    while (!domain.queued.empty() && now - domain.queued.front()->queued >= DELIVERY_QUEUE_TIMEOUT) {
+        if (logEnabled(LOG_WARN)) {
+            logRecord(LOG_WARN, "event=delivery_deferred domain=%s reason=queue_timeout queued=%zu",
+                      logValue(domain.name).c_str(), domain.queued.size());
+        }
+        complete(domain.queued.front(), RELAY_DEFERRED);
+        domain.queued.pop_front();
+    }
+}
+
+// Forget domains we haven't talked to in a while, and what we learned
+// about them with it
+void DeliveryScheduler::prune(chrono::steady_clock::time_point now)
+{
+    for (auto it = domains.begin(); it != domains.end();) {
+        Domain const &domain = it->second;
+        if (!domain.inRing && domain.active == 0 && now - domain.lastUsed >= DOMAIN_IDLE_EXPIRY) {
+            it = domains.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    lastPrune = now;
+}
+
+// ***************************************************************************
+// * dispatch()
+// *  Go round the domains with queued work, starting one delivery for each
+// *  that is under its limits, until a whole lap starts nothing or we hit
+// *  MAX_ACTIVE_RELAYS. Returns when it wants to be woken up again if
+// *  nothing else happens first.
+// ***************************************************************************
+chrono::steady_clock::time_point DeliveryScheduler::dispatch(chrono::steady_clock::time_point now)
+{
+    auto next = now + DISPATCH_SWEEP_INTERVAL;
+
+    for (Domain *domain : ring) {
+        expire(*domain, now);
+    }
+
+    size_t idle = 0;
+    while (active < MAX_ACTIVE_RELAYS && idle < ring.size()) {
+        Domain *domain = ring.front();
+        ring.pop_front();
+
+        if (domain->queued.empty()) {
+            domain->inRing = false;
+            continue;
+        }
+
+        ring.push_back(domain);
+        if (domain->active >= (int)domain->concurrency) {
+            idle++;
+            continue;
+        }
+        if (now < domain->nextStart) {
+            next = min(next, domain->nextStart);
+            idle++;
+            continue;
+        }
+
+        DeliveryJob *job = domain->queued.front();
+        domain->queued.pop_front();
+        domain->active++;
+        active++;
+
+        auto spacing = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1 / domain->rate));
+        domain->nextStart = max(now, domain->nextStart) + spacing;
+        domain->lastUsed = now;
+        job->started = now;
+
+        spawn(ioScheduler.next(), run(job));
+        idle = 0;
+    }
+
+    if (now - lastPrune >= DOMAIN_IDLE_EXPIRY) {
+        prune(now);
+    }
+
+    return next;
+}
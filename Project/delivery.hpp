@@ -0,0 +1,125 @@
+#ifndef __DELIVERY_HPP_
+#define __DELIVERY_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "async.hpp"
+
+using namespace std;
+
+// ************************************************************************
+// * Delivery scheduler
+// *  Every relay goes through one queue per destination domain. A single
+// *  dispatcher thread walks the domains that have work round-robin and
+// *  starts at most one delivery per domain per turn, so a domain with a
+// *  thousand messages waiting can't crowd out one with a single message.
+// *
+// *  Each domain has a concurrency limit and a rate limit of its own. Both
+// *  grow while deliveries succeed and are halved when the remote answers
+// *  4xx or won't take the connection; a domain that still says no at one
+// *  connection is paused, with exponential backoff. A message that got a
+// *  4xx goes back on the front of its queue for another try.
+// ************************************************************************
+const static int MAX_ACTIVE_RELAYS = 256;
+const static double DOMAIN_INITIAL_CONCURRENCY = 4;
+const static double DOMAIN_MAX_CONCURRENCY = 20;
+const static double DOMAIN_MAX_RATE = 100; // messages per second
+const static double DOMAIN_MIN_RATE = 1;
+const static double DOMAIN_RATE_GROWTH = 0.05; // per successful delivery
+const static int DOMAIN_MAX_QUEUED = 1000;
+const static int DELIVERY_MAX_ATTEMPTS = 3;
+const static chrono::milliseconds DOMAIN_MIN_BACKOFF{1000};
+const static chrono::milliseconds DOMAIN_MAX_BACKOFF{60000};
+const static chrono::seconds DELIVERY_QUEUE_TIMEOUT{300};
+const static chrono::seconds DOMAIN_IDLE_EXPIRY{600};
+
+// One message waiting for, or in, delivery. It lives in the frame of the
+// coroutine that asked for it, which sleeps until the job is done.
+struct DeliveryJob {
+    string domain;
+    string const *reversePath;
+    string const *forwardPath;
+    string const *message;
+    chrono::steady_clock::time_point queued;
+    chrono::steady_clock::time_point started;
+    int attempts = 0;
+    int result = 0;
+    EventLoop *loop = nullptr;
+    coroutine_handle<> waiter;
+};
+
+class DeliveryScheduler {
+public:
+    // Does one delivery attempt and returns a relay result (relay.hpp)
+    using Transport = function<Task<int>(string const &, string const &, string const &)>;
+
+    void start(Transport transport);
+    // Fails everything still queued with RELAY_DEFERRED
+    void stop();
+
+    struct Awaiter {
+        DeliveryScheduler &scheduler;
+        DeliveryJob job;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h)
+        {
+            job.loop = EventLoop::current();
+            job.waiter = h;
+            scheduler.enqueue(&job);
+        }
+        int await_resume() const noexcept { return job.result; }
+    };
+
+    // co_await deliver(...) queues the message behind its domain and
+    // resumes with the relay result once it went out or was given up on
+    Awaiter deliver(string const &reversePath, string const &forwardPath, string const &message);
+
+private:
+    struct Domain {
+        string name;
+        deque<DeliveryJob *> queued;
+        int active = 0;
+        double concurrency = DOMAIN_INITIAL_CONCURRENCY;
+        double rate = DOMAIN_MAX_RATE;
+        chrono::milliseconds backoff{0};
+        chrono::steady_clock::time_point nextStart;
+        chrono::steady_clock::time_point lastCut;
+        chrono::steady_clock::time_point lastUsed;
+        bool inRing = false;
+    };
+
+    void enqueue(DeliveryJob *job);
+    void finished(DeliveryJob *job, int result);
+    Task<void> run(DeliveryJob *job);
+
+    // Dispatcher thread only, with lock held
+    chrono::steady_clock::time_point dispatch(chrono::steady_clock::time_point now);
+    void expire(Domain &domain, chrono::steady_clock::time_point now);
+    void prune(chrono::steady_clock::time_point now);
+
+    // With lock held: hand the result back, the job is gone after this
+    void complete(DeliveryJob *job, int result);
+    void schedule(Domain &domain);
+
+    Transport transport;
+    mutex lock;
+    condition_variable wake;
+    thread dispatcher;
+    bool stopping = false;
+    unordered_map<string, Domain> domains;
+    deque<Domain *> ring; // domains with queued work, in turn order
+    int active = 0;
+    chrono::steady_clock::time_point lastPrune;
+};
+
+extern DeliveryScheduler deliveryScheduler;
+
+#endif
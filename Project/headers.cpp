@@ -0,0 +1,161 @@
+#include "headers.hpp"
+
+#include <strings.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+// Room for the From_ line and the headers we add, so out only grows once
+const static size_t TRACE_HEADER_RESERVE = 512;
+
+static thread_local Timestamps timestampCache = {-1, "", ""};
+static atomic<unsigned long> messageIdSequence{0};
+
+Timestamps const &currentTimestamps()
+{
+    time_t now = time(nullptr);
+    if (now != timestampCache.second) {
+        struct tm timeInfo;
+        localtime_r(&now, &timeInfo);
+        strftime(timestampCache.mbox, sizeof(timestampCache.mbox), "%a %b %e %T %Y", &timeInfo);
+        strftime(timestampCache.rfc5322, sizeof(timestampCache.rfc5322), "%a, %d %b %Y %T %z", &timeInfo);
+        timestampCache.second = now;
+    }
+    return timestampCache;
+}
+
+void appendReceived(string &out, MessageTrace const &trace, string const &hostname)
+{
+    // RFC 5321 4.4, the client's address without the port
+    string address = trace.client.substr(0, trace.client.rfind(':'));
+    char const *protocol = trace.esmtp ? (trace.tls ? "ESMTPS" : "ESMTP") : "SMTP";
+
+    out += "Received: from ";
+    out += trace.heloName.empty() ? "unknown" : trace.heloName;
+    out += " ([";
+    out += address;
+    out += "])\r\n\tby ";
+    out += hostname;
+    out += " with ";
+    out += protocol;
+    out += "\r\n\tfor <";
+    out += trace.forwardPath;
+    out += ">; ";
+    out += currentTimestamps().rfc5322;
+    out += "\r\n";
+}
+
+// "Name:" at the start of a line, RFC 5322 2.2. Continuation lines count
+// as part of the field before them.
+static bool isHeaderLine(char const *line, char const *end)
+{
+    if (line < end && (*line == ' ' || *line == '\t')) {
+        return true;
+    }
+    char const *c = line;
+    while (c < end && *c > ' ' && *c < 127 && *c != ':') {
+        c++;
+    }
+    return c > line && c < end && *c == ':';
+}
+
+static bool isField(char const *line, char const *end, char const *name)
+{
+    size_t length = strlen(name);
+    return (size_t)(end - line) > length && line[length] == ':' && strncasecmp(line, name, length) == 0;
+}
+
+static void appendMissing(string &out, bool hasDate, bool hasMessageId, string const &hostname)
+{
+    if (!hasDate) {
+        out += "Date: ";
+        out += currentTimestamps().rfc5322;
+        out += "\r\n";
+    }
+    if (!hasMessageId) {
+        char id[64];
+        snprintf(id, sizeof(id), "<%lx.%lx.%x@", (unsigned long)time(nullptr), messageIdSequence.fetch_add(1) + 1,
+                 (unsigned int)getpid());
+        out += "Message-ID: ";
+        out += id;
+        out += hostname;
+        out += ">\r\n";
+    }
+}
+
+// ***************************************************************************
+// * buildMailboxEntry()
+// *  One walk over the message, a line at a time. memchr() finds each line
+// *  end (glibc does it with SIMD, many bytes per step), and runs of lines
+// *  that need nothing are copied in one go. Headers are over at the first
+// *  line that isn't one; that is where anything missing goes in.
+// ***************************************************************************
+void buildMailboxEntry(string &out, MessageTrace const &trace, string const &hostname, string const &message)
+{
+    Timestamps const &now = currentTimestamps();
+    out.reserve(out.length() + message.length() + TRACE_HEADER_RESERVE);
+
+    out += "From ";
+    out += trace.reversePath.empty() ? "MAILER-DAEMON" : trace.reversePath;
+    out += ' ';
+    out += now.mbox;
+    out += '\n';
+
+    out += "Return-Path: <";
+    out += trace.reversePath;
+    out += ">\r\n";
+    appendReceived(out, trace, hostname);
+
+    char const *data = message.data();
+    char const *end = data + message.length();
+    char const *copied = data;
+    char const *line = data;
+    bool inHeaders = true;
+    bool hasDate = false;
+    bool hasMessageId = false;
+
+    while (line < end) {
+        char const *newline = (char const *)memchr(line, '\n', end - line);
+        char const *next = newline != nullptr ? newline + 1 : end;
+
+        if (inHeaders) {
+            if (isHeaderLine(line, next)) {
+                hasDate = hasDate || isField(line, next, "Date");
+                hasMessageId = hasMessageId || isField(line, next, "Message-ID");
+                line = next;
+                continue;
+            }
+
+            out.append(copied, line);
+            copied = line;
+            appendMissing(out, hasDate, hasMessageId, hostname);
+            inHeaders = false;
+
+            // A body with no blank line before it would read as more headers
+            if (*line != '\r' && *line != '\n') {
+                out += "\r\n";
+            }
+        }
+
+        // mboxrd: From, >From, >>From, ... each get one more '>'
+        char const *c = line;
+        while (c < next && *c == '>') {
+            c++;
+        }
+        if (next - c >= 5 && memcmp(c, "From ", 5) == 0) {
+            out.append(copied, line);
+            out += '>';
+            copied = line;
+        }
+
+        line = next;
+    }
+
+    out.append(copied, end);
+    if (inHeaders) {
+        appendMissing(out, hasDate, hasMessageId, hostname);
+    }
+    out += '\n';
+}
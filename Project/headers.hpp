@@ -0,0 +1,45 @@
+#ifndef __HEADERS_HPP_
+#define __HEADERS_HPP_
+
+#include <ctime>
+#include <string>
+
+using namespace std;
+
+// ************************************************************************
+// * Trace headers and mbox entries
+// *  Everything we add to a message on its way in: Return-Path: and
+// *  Received: on top, Date: and Message-ID: if the sender left them out,
+// *  and ">From " escaping so the mailbox still splits where it should.
+// *  All of it happens in one pass over the message.
+// ************************************************************************
+
+// What we know about the session a message came in on
+struct MessageTrace {
+    string heloName;
+    string client; // "ip:port"
+    bool esmtp = false;
+    bool tls = false;
+    string reversePath;
+    string forwardPath;
+};
+
+// "now" formatted for the mbox From_ line and for header dates. Each
+// thread keeps its own copy and only reformats when the second changes,
+// so this is cheap and safe to call from anywhere.
+struct Timestamps {
+    time_t second;
+    char mbox[32];    // Thu Oct  1 12:34:56 2026
+    char rfc5322[40]; // Thu, 01 Oct 2026 12:34:56 +0000
+};
+Timestamps const &currentTimestamps();
+
+// Appends "Received: ..." for a message we accepted as hostname
+void appendReceived(string &out, MessageTrace const &trace, string const &hostname);
+
+// Appends message to out as one mbox entry: From_ line, trace headers,
+// any missing Date:/Message-ID:, the message with From lines escaped
+// (mboxrd), and the blank line that ends it.
+void buildMailboxEntry(string &out, MessageTrace const &trace, string const &hostname, string const &message);
+
+#endif
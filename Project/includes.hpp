@@ -5,6 +5,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -20,6 +25,16 @@
 #include <string>
 #include <set>
 #include <algorithm>
+#include <chrono>
+
+#include "async.hpp"
+#include "delivery.hpp"
+#include "headers.hpp"
+#include "log.hpp"
+#include "recipients.hpp"
+#include "relay.hpp"
+#include "tls.hpp"
+#include "upgrade.hpp"
 
 using namespace std;
 
@@ -34,30 +49,32 @@ const static int DATA = 4;
 const static int RSET = 5;
 const static int NOOP = 6;
 const static int QUIT = 7;
+const static int STARTTLS = 8;
 
 // ************************************************************************
 // * Local functions we are going to use.
 // ************************************************************************
-string readCommand(int sockfd);
+Task<bool> readCommand(AsyncSocket &, string &);
 int parseCommand(string commandString);
-void *processConnection(void *arg);
+Task<void> processConnection(int sockfd);
+string getPeerName(int sockfd);
+int createListenSocket(int port);
+void acceptConnections(vector<int> const &, int, int);
+void raiseFileLimit();
 string getFqHostname();
-void doHelloCommand(int, string const &);
+Task<void> doHelloCommand(AsyncSocket &, string const &);
+Task<bool> doStartTlsCommand(AsyncSocket &, string const &);
 int doMailCommand(int, string const &, string &);
 int doRcptCommand(int, string const &, string &);
-int doDataCommand(int);
-void doRsetCommand(int);
-void doNoopCommand(int);
-void doQuitCommand(int, string const &);
-void doUnknownCommand(int);
-void doError(int, string const &, string const &);
-void doSuccess(int, string const &, string const &);
-void fetchMessageBuffer(int, string &);
-void processMessage(int, string const &, string const &, string const &);
-int writeToLocalFilesystem(string const &, string const &, string const &);
-int attemptToRelay(string const &, string const &, string const &);
-bool isLocalRecipient(string const &);
-int getMxRecord(string const &, string &);
+Task<void> doRsetCommand(AsyncSocket &);
+Task<void> doNoopCommand(AsyncSocket &);
+Task<void> doQuitCommand(AsyncSocket &, string const &);
+Task<void> doUnknownCommand(AsyncSocket &);
+Task<void> doError(AsyncSocket &, string const &, string const &);
+Task<void> doSuccess(AsyncSocket &, string const &, string const &);
+Task<bool> fetchMessageBuffer(AsyncSocket &, string &, bool &);
+Task<int> processMessage(AsyncSocket &, MessageTrace const &, string const &);
+int writeToLocalFilesystem(MessageTrace const &, string const &, string const &);
 string trim_ref(string &);
 string trim_val(string);
 
@@ -0,0 +1,273 @@
+#include "log.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const static int LOG_RING_SLOTS = 1024; // per thread, must be a power of two
+const static int LOG_TEXT_SIZE = 244;
+const static int LOG_IDLE_SLEEP_MS = 20;
+
+static char const *const LOG_LEVEL_NAMES[] = {"error", "warn", "info", "debug"};
+
+struct LogSlot {
+    int64_t when; // ns since the epoch
+    int32_t level;
+    char text[LOG_TEXT_SIZE];
+};
+
+// Single producer (the owning thread), single consumer (the writer)
+struct LogRing {
+    alignas(64) atomic<uint64_t> head{0};
+    alignas(64) atomic<uint64_t> tail{0};
+    atomic<uint64_t> dropped{0};
+    uint64_t droppedReported = 0; // writer only
+    LogSlot slots[LOG_RING_SLOTS];
+};
+
+atomic<int> logLevel{LOG_INFO};
+
+static int startLevel = LOG_INFO;
+static int logfd = STDERR_FILENO;
+static atomic<bool> writerRunning{false};
+static thread writerThread;
+
+// Taken once per thread when its ring is created, and by the writer to
+// see the list. Never on the logging path itself.
+static mutex ringsLock;
+static vector<LogRing *> rings;
+static thread_local LogRing *threadRing = nullptr;
+
+static int64_t nowNanos()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int parseLogLevel(string const &name)
+{
+    for (int level = LOG_ERROR; level <= LOG_DEBUG; level++) {
+        if (name == LOG_LEVEL_NAMES[level]) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+void setLogLevel(int level) { logLevel.store(level, memory_order_relaxed); }
+
+void toggleDebugLogging() { setLogLevel(logLevel.load(memory_order_relaxed) == LOG_DEBUG ? startLevel : LOG_DEBUG); }
+
+string logValue(string const &value)
+{
+    if (!value.empty() && value.find_first_of(" \t=\"\\") == string::npos) {
+        return value;
+    }
+
+    string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    quoted += '"';
+    return quoted;
+}
+
+// ***************************************************************************
+// * logRecord()
+// *  The hot path. Claim the next slot in this thread's ring, format into
+// *  it, publish it. A full ring costs one counter increment.
+// ***************************************************************************
+static void appendRecord(int level, char const *format, va_list args)
+{
+    if (threadRing == nullptr) {
+        threadRing = new LogRing();
+        lock_guard<mutex> guard(ringsLock);
+        rings.push_back(threadRing);
+    }
+
+    LogRing *ring = threadRing;
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) >= LOG_RING_SLOTS) {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    LogSlot &slot = ring->slots[head & (LOG_RING_SLOTS - 1)];
+    slot.when = nowNanos();
+    slot.level = level;
+    vsnprintf(slot.text, sizeof(slot.text), format, args);
+
+    ring->head.store(head + 1, memory_order_release);
+}
+
+void logRecord(int level, char const *format, ...)
+{
+    if (!logEnabled(level)) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    appendRecord(level, format, args);
+    va_end(args);
+}
+
+void logFatal(char const *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    appendRecord(LOG_ERROR, format, args);
+    va_end(args);
+
+    // Not exit(): the static destructors would find the event loop and
+    // pool threads still running and call terminate(). Nothing else needs
+    // an orderly end, the record does.
+    stopLogger();
+    _exit(-1);
+}
+
+// Writer side: turn one record into a line
+static void appendLine(string &out, int64_t when, int level, char const *text)
+{
+    time_t seconds = when / 1000000000;
+    struct tm timeInfo;
+    gmtime_r(&seconds, &timeInfo);
+
+    char stamp[64];
+    size_t length = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &timeInfo);
+    snprintf(stamp + length, sizeof(stamp) - length, ".%03dZ", (int)((when / 1000000) % 1000));
+
+    out += stamp;
+    out += " level=";
+    out += LOG_LEVEL_NAMES[level];
+    out += ' ';
+
+    // One record, one line, whatever a client put in its envelope
+    for (char const *c = text; *c != '\0'; c++) {
+        out += (*c == '\n' || *c == '\r') ? ' ' : *c;
+    }
+    out += '\n';
+}
+
+static void writeOut(string &out)
+{
+    size_t offset = 0;
+    while (offset < out.length()) {
+        ssize_t len = write(logfd, out.data() + offset, out.length() - offset);
+        if (len <= 0) {
+            break;
+        }
+        offset += len;
+    }
+    out.clear();
+}
+
+// ***************************************************************************
+// * drainRings()
+// *  Empty every ring once. The records taken go out merged by time, not
+// *  ring by ring, so the log reads in the order things happened. Returns
+// *  false if there was nothing to do.
+// ***************************************************************************
+static bool drainRings(string &out)
+{
+    vector<LogRing *> snapshot;
+    {
+        lock_guard<mutex> guard(ringsLock);
+        snapshot = rings;
+    }
+
+    // Writer only, kept to save the allocation on every pass
+    static vector<LogSlot const *> taken;
+    static vector<uint64_t> heads;
+    taken.clear();
+    heads.clear();
+
+    for (LogRing *ring : snapshot) {
+        uint64_t head = ring->head.load(memory_order_acquire);
+        for (uint64_t tail = ring->tail.load(memory_order_relaxed); tail != head; tail++) {
+            taken.push_back(&ring->slots[tail & (LOG_RING_SLOTS - 1)]);
+        }
+        heads.push_back(head);
+    }
+
+    stable_sort(taken.begin(), taken.end(), [](LogSlot const *a, LogSlot const *b) { return a->when < b->when; });
+    for (LogSlot const *slot : taken) {
+        appendLine(out, slot->when, slot->level, slot->text);
+    }
+
+    // Only now can the producers have the slots back
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        LogRing *ring = snapshot[i];
+        ring->tail.store(heads[i], memory_order_release);
+
+        uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+        if (dropped != ring->droppedReported) {
+            char text[LOG_TEXT_SIZE];
+            snprintf(text, sizeof(text), "event=log_dropped count=%llu",
+                     (unsigned long long)(dropped - ring->droppedReported));
+            appendLine(out, nowNanos(), LOG_WARN, text);
+            ring->droppedReported = dropped;
+        }
+    }
+
+    if (out.empty()) {
+        return false;
+    }
+
+    writeOut(out);
+    return true;
+}
+
+void startLogger()
+{
+    char const *level = getenv("SMTP_LOG_LEVEL");
+    if (level != nullptr && parseLogLevel(level) >= 0) {
+        startLevel = parseLogLevel(level);
+        setLogLevel(startLevel);
+    }
+
+    char const *file = getenv("SMTP_LOG_FILE");
+    if (file != nullptr) {
+        int fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            logfd = fd;
+        }
+    }
+
+    // A joinable writerThread left at exit() would abort the process
+    atexit(stopLogger);
+
+    writerRunning = true;
+    writerThread = thread([]() {
+        string out;
+        while (writerRunning) {
+            if (!drainRings(out)) {
+                this_thread::sleep_for(chrono::milliseconds(LOG_IDLE_SLEEP_MS));
+            }
+        }
+        // Whatever was logged before stopLogger() still goes out
+        while (drainRings(out)) {
+        }
+    });
+}
+
+void stopLogger()
+{
+    if (!writerRunning.exchange(false)) {
+        return;
+    }
+    writerThread.join();
+    if (logfd != STDERR_FILENO) {
+        close(logfd);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef __LOG_HPP_
+#define __LOG_HPP_
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// ************************************************************************
+// * Structured logging
+// *  Every thread that logs gets its own fixed-size ring. Writing a record
+// *  is a format into the next free slot and one release store, with no
+// *  lock and no allocation. A background thread drains the rings and
+// *  writes logfmt lines (key=value) to stderr or $SMTP_LOG_FILE.
+// *
+// *  If a ring is full the record is dropped and counted; the writer
+// *  reports the count. Logging never makes an SMTP session wait.
+// ************************************************************************
+const static int LOG_ERROR = 0;
+const static int LOG_WARN = 1;
+const static int LOG_INFO = 2;
+const static int LOG_DEBUG = 3;
+
+extern atomic<int> logLevel;
+
+inline bool logEnabled(int level) { return level <= logLevel.load(memory_order_relaxed); }
+
+// Reads $SMTP_LOG_LEVEL (error, warn, info, debug) and $SMTP_LOG_FILE,
+// then starts the writer thread. It is stopped again at exit().
+void startLogger();
+// Drains whatever is left and stops the writer thread.
+void stopLogger();
+void setLogLevel(int level);
+int parseLogLevel(string const &name);
+// Flips between LOG_DEBUG and the level we started with (SIGUSR1)
+void toggleDebugLogging();
+
+// A value as it should appear after key=: as is if it is a plain word,
+// otherwise in double quotes with " and \ escaped. Anything a client sent
+// goes through this so it can't pass for fields of its own. It allocates:
+// test logEnabled() first rather than build one for a record nobody keeps.
+string logValue(string const &value);
+
+// printf-style; the text should be key=value fields
+void logRecord(int level, char const *format, ...) __attribute__((format(printf, 2, 3)));
+// Logs at LOG_ERROR, flushes the log and _exit()s. Safe with other
+// threads still running, it skips static destructors and atexit().
+[[noreturn]] void logFatal(char const *format, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
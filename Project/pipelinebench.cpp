@@ -0,0 +1,171 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "async.hpp"
+#include "log.hpp"
+
+// ***************************************************************************
+// * pipelinebench
+// *  A client that pipelines thousands of commands finds every line
+// *  already buffered, so none of the reads ever has to wait. This floods
+// *  one session with them and checks that:
+// *   - every command gets its reply (nothing overflows the stack; build
+// *     this the way project1 is built, without optimization, to mean it)
+// *   - another session on the same event loop still gets answered quickly
+// *
+// *  usage: pipelinebench [lines]     exits non-zero if either check fails
+// ***************************************************************************
+const static int DEFAULT_LINES = 200000;
+const static int MAX_LINE = 1024;
+const static int PROBES = 20;
+const static chrono::milliseconds MAX_PROBE_LATENCY{500};
+
+// Reads through a nested task like processConnection()'s readCommand()
+static Task<bool> readCommand(AsyncSocket &sock, string &line)
+{
+    bool received = co_await sock.readLine(line, MAX_LINE);
+    co_return received;
+}
+
+static Task<void> session(int fd)
+{
+    AsyncSocket sock(fd);
+    string line;
+
+    while (true) {
+        bool received = co_await readCommand(sock, line);
+        if (!received) {
+            break;
+        }
+        bool sent = co_await sock.writeAll("250 OK\r\n");
+        if (!sent) {
+            break;
+        }
+    }
+}
+
+static int connectTo(int port)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Counts reply lines until count of them came back or the peer went away
+static int readReplies(int fd, int count)
+{
+    char buffer[65536];
+    int replies = 0;
+    while (replies < count) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+        replies += count_if(buffer, buffer + len, [](char c) { return c == '\n'; });
+    }
+    return replies;
+}
+
+int main(int argc, char **argv)
+{
+    int lines = argc > 1 ? atoi(argv[1]) : DEFAULT_LINES;
+    if (lines <= 0) {
+        fprintf(stderr, "usage %s [lines]\n", argv[0]);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setLogLevel(LOG_ERROR);
+    startLogger();
+
+    // One loop, so the flood and the probe have to share it
+    ioScheduler.start(1);
+
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrLength = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, SOMAXCONN) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrLength) < 0) {
+        fprintf(stderr, "listen failed: %s\n", strerror(errno));
+        return -1;
+    }
+    int port = ntohs(addr.sin_port);
+
+    thread([listenfd]() {
+        int connfd = -1;
+        while ((connfd = accept(listenfd, nullptr, nullptr)) >= 0) {
+            spawn(ioScheduler.next(), session(connfd));
+        }
+    }).detach();
+
+    int probefd = connectTo(port);
+    int floodfd = connectTo(port);
+    if (probefd < 0 || floodfd < 0) {
+        fprintf(stderr, "connect failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The whole flood goes out at once, from its own thread
+    string flood;
+    for (int i = 0; i < lines; i++) {
+        flood += "NOOP\r\n";
+    }
+    thread sender([floodfd, &flood]() {
+        size_t offset = 0;
+        while (offset < flood.length()) {
+            ssize_t len = write(floodfd, flood.data() + offset, flood.length() - offset);
+            if (len <= 0) {
+                break;
+            }
+            offset += len;
+        }
+    });
+
+    atomic<int> floodReplies{-1};
+    auto start = chrono::steady_clock::now();
+    thread reader([floodfd, lines, &floodReplies]() { floodReplies = readReplies(floodfd, lines); });
+
+    // Meanwhile, one command at a time on the other session
+    chrono::steady_clock::duration worstProbe{0};
+    int probesAnswered = 0;
+    for (int i = 0; i < PROBES && floodReplies < 0; i++) {
+        auto sent = chrono::steady_clock::now();
+        if (write(probefd, "NOOP\r\n", 6) != 6 || readReplies(probefd, 1) != 1) {
+            break;
+        }
+        worstProbe = max(worstProbe, chrono::steady_clock::now() - sent);
+        probesAnswered++;
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+
+    sender.join();
+    reader.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double worstMs = chrono::duration<double, milli>(worstProbe).count();
+
+    bool ok = floodReplies == lines && worstProbe <= MAX_PROBE_LATENCY;
+    printf("%d pipelined lines: %d replies in %.2f s; other session: %d probes, worst %.1f ms  %s\n", lines,
+           floodReplies.load(), seconds, probesAnswered, worstMs, ok ? "ok" : "FAILED");
+
+    // The acceptor is still parked in accept(), skip the static teardown
+    stopLogger();
+    fflush(stdout);
+    _exit(ok ? 0 : 1);
+}
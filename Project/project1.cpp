@@ -1,26 +1,31 @@
 #include "includes.hpp"
 
 const static int MAXLINE = 1024;
+const static int MAX_DATA_LINE = 65536;
 const static int PORT = 10001;
-const static int SMTP_PORT = 25;
-const static bool DEBUG = false;
+const static int RESOLVER_THREADS = 4;
+const static int DRAIN_TIMEOUT = 120;
+const static chrono::milliseconds ACCEPT_BACKOFF{100};
+const static rlim_t MAX_OPEN_FILES = 1048576;
+const static chrono::minutes SESSION_TIMEOUT{5}; // RFC 5321 4.5.3.2.7
+const static chrono::seconds TLS_HANDSHAKE_TIMEOUT{60};
+const static char UPGRADE_SOCKET_PATH[] = "smtp-upgrade.sock";
+const static char RECIPIENT_DB_PATH[] = "recipients.db";
+const static char TRANSPORT_MAP_PATH[] = "transport";
+const static char TLS_CERT_PATH[] = "smtp.crt";
+const static char TLS_KEY_PATH[] = "smtp.key";
+const static char TLS_TICKET_KEY_PATH[] = "smtp.ticketkeys";
 const static string fqHostname = getFqHostname();
 
 // ***************************************************************************
 // * Read the command from the socket.
-// *  Simply read a line from the socket and return it as a string.
+// *  Simply read a line from the socket and hand it back as a string.
+// *  Returns false once the client has gone away or gone quiet for longer
+// *  than SESSION_TIMEOUT.
 // ***************************************************************************
-string readCommand(int sockfd)
+Task<bool> readCommand(AsyncSocket &sock, string &cmdString)
 {
-    char buffer[MAXLINE];
-    int size = read(sockfd, buffer, MAXLINE);
-
-    // read() doesn't put the null terminator on the string automatically... :(
-    if (size >= 0) {
-        buffer[size] = '\0';
-    }
-
-    return string(buffer);
+    co_return co_await sock.readLine(cmdString, MAXLINE, SESSION_TIMEOUT);
 }
 
 // ***************************************************************************
@@ -40,6 +45,9 @@ int parseCommand(string commandString)
         command = commandString;
     }
 
+    // Verbs are case-insensitive (RFC 5321 2.4)
+    transform(command.begin(), command.end(), command.begin(), ::toupper);
+
     if (command == "HELO" || command == "EHLO") {
         return HELO;
     }
@@ -61,28 +69,26 @@ int parseCommand(string commandString)
     else if (command == "QUIT") {
         return QUIT;
     }
+    else if (command == "STARTTLS") {
+        return STARTTLS;
+    }
 
     return -1;
 }
 
 // ***************************************************************************
 // * processConnection()
-// *  Master function for processing thread.
-// *  !!! NOTE - the IOSTREAM library and the cout varibables may or may
-// *      not be thread safe depending on your system.  I use the cout
-// *      statments for debugging when I know there will be just one thread
-// *      but once you are processing multiple requests it might cause problems.
+// *  Master coroutine for one SMTP session. Every co_await is a point where
+// *  the session gives its thread back to the event loop, so a handful of
+// *  threads can carry thousands of sessions.
+// *  Diagnostics go through logRecord(), never cout: it is safe from any
+// *  thread and never makes the session wait.
 // ***************************************************************************
-void *processConnection(void *arg)
+Task<void> processConnection(int sockfd)
 {
-    // *******************************************************
-    // * This is a little bit of a cheat, but if you end up
-    // * with a FD of more than 64 bits you are in trouble
-    // *******************************************************
-    int sockfd = *(int *)arg;
-    delete (int *)arg;
-    if (DEBUG)
-        cout << "We are in the thread with fd = " << sockfd << endl;
+    AsyncSocket sock(sockfd);
+    string client = getPeerName(sockfd);
+    logRecord(LOG_DEBUG, "event=connect client=%s fd=%d", client.c_str(), sockfd);
 
     bool connectionActive = true;
     bool seenMAIL = false;
@@ -92,6 +98,9 @@ void *processConnection(void *arg)
     string reversePath = "";
     string messageBuffer = "";
     string cmdString = "";
+    string heloName = "";
+    bool esmtp = false;
+    chrono::steady_clock::time_point transactionStart;
 
     // C++11/14 lambda to reset the state of the server
     // reduces code duplication
@@ -105,18 +114,37 @@ void *processConnection(void *arg)
         messageBuffer = "";
     };
 
+    sessionTracker.add(sockfd);
+
     // Write 220-ready code
     string message = "220 " + fqHostname + " service ready\n";
-    write(sockfd, message.c_str(), message.length());
+    connectionActive = co_await sock.writeAll(message, SESSION_TIMEOUT);
 
     while (connectionActive) {
         // *******************************************************
-        // * Read the command from the socket.
+        // * Read the command from the socket. If the server is
+        // * draining, this is where we tell the client to go away.
         // *******************************************************
-        if (DEBUG) {
-            cout << "Reading from socketfd = " << sockfd << endl;
+        if (!sessionTracker.enterIdle(sockfd, seenMAIL)) {
+            co_await doError(sock, "421", fqHostname + " service shutting down");
+            break;
+        }
+        bool gotCommand = co_await readCommand(sock, cmdString);
+        sessionTracker.leaveIdle(sockfd);
+        if (!gotCommand) {
+            if (sessionTracker.draining()) {
+                co_await doError(sock, "421", fqHostname + " service shutting down");
+            }
+            else if (sock.timedOut()) {
+                co_await doError(sock, "421", fqHostname + " timeout, closing connection");
+                logRecord(LOG_DEBUG, "event=timeout client=%s", client.c_str());
+            }
+            break;
+        }
+        if (sock.lineTooLong()) {
+            co_await doError(sock, "500", "line too long");
+            continue;
         }
-        cmdString = readCommand(sockfd);
         cmdString = trim_ref(cmdString);
 
         // *******************************************************
@@ -130,20 +158,28 @@ void *processConnection(void *arg)
         int result = -1;
         switch (command) {
         case HELO:
-            doHelloCommand(sockfd, cmdString);
+            co_await doHelloCommand(sock, cmdString);
+
+            // Remembered for the Received: line
+            if (cmdString.find(' ') != string::npos) {
+                heloName = cmdString.substr(cmdString.find(' ') + 1);
+                esmtp = strncasecmp(cmdString.c_str(), "EHLO", 4) == 0;
+            }
             break;
         case MAIL:
             resetState();
             result = doMailCommand(sockfd, cmdString, reversePath);
 
             if (result != 0) {
-                doError(sockfd, "501", "reverse path not well-formed");
+                co_await doError(sock, "501", "reverse path not well-formed");
             }
             else {
                 seenMAIL = true;
-                doSuccess(sockfd, "250", "reverse path ok");
-                if (DEBUG) {
-                    cout << "Setting reverse path: " << reversePath << endl;
+                transactionStart = chrono::steady_clock::now();
+                co_await doSuccess(sock, "250", "reverse path ok");
+                if (logEnabled(LOG_DEBUG)) {
+                    logRecord(LOG_DEBUG, "event=mail client=%s from=%s", client.c_str(),
+                              logValue("<" + reversePath + ">").c_str());
                 }
             }
 
@@ -153,20 +189,35 @@ void *processConnection(void *arg)
         case RCPT:
             // Only work if you've seen MAIL command
             if (!seenMAIL) {
-                doError(sockfd, "503", "sender info not yet given");
+                co_await doError(sock, "503", "sender info not yet given");
             }
             else {
-                result = doRcptCommand(sockfd, cmdString, forwardPath);
+                // A rejected RCPT must leave the one already accepted alone
+                string recipientPath;
+                result = doRcptCommand(sockfd, cmdString, recipientPath);
                 if (result < 0) {
-                    doError(sockfd, "501", "forward path not well-formed");
+                    co_await doError(sock, "501", "forward path not well-formed");
                 }
                 else {
-                    seenRCPT = true;
-                    if (isLocalRecipient(forwardPath)) {
-                        doSuccess(sockfd, "250", "forward path ok");
+                    string mailbox;
+                    int recipient = lookupRecipient(recipientPath, mailbox);
+                    if (recipient == RECIPIENT_UNKNOWN) {
+                        co_await doError(sock, "550", "no such user here");
+                        if (logEnabled(LOG_INFO)) {
+                            logRecord(LOG_INFO, "event=rcpt_rejected result=550 client=%s from=%s to=%s",
+                                      client.c_str(), logValue("<" + reversePath + ">").c_str(),
+                                      logValue("<" + recipientPath + ">").c_str());
+                        }
+                    }
+                    else if (recipient == RECIPIENT_LOCAL) {
+                        forwardPath = recipientPath;
+                        seenRCPT = true;
+                        co_await doSuccess(sock, "250", "forward path ok");
                     }
                     else {
-                        doSuccess(sockfd, "251", "recipient not local, will attempt to forward");
+                        forwardPath = recipientPath;
+                        seenRCPT = true;
+                        co_await doSuccess(sock, "251", "recipient not local, will attempt to forward");
                     }
                 }
             }
@@ -174,66 +225,123 @@ void *processConnection(void *arg)
         case DATA:
             // Only work if you've seen MAIL and RCPT command
             if (!seenRCPT) {
-                doError(sockfd, "503", "valid RCPT must precede DATA");
+                co_await doError(sock, "503", "valid RCPT must precede DATA");
             }
             else {
-                doSuccess(sockfd, "354", "Start mail input; end with <CRLF>.<CRLF>");
-                fetchMessageBuffer(sockfd, messageBuffer);
-                processMessage(sockfd, reversePath, forwardPath, messageBuffer);
-
-                // if (result != 0) {
-                //     doError(sockfd, "451", "Local error in processing");
-                // }
-                // else {
-                //     doSuccess(sockfd, "250", "OK");
-                // }
+                co_await doSuccess(sock, "354", "Start mail input; end with <CRLF>.<CRLF>");
+                bool lineTooLong = false;
+                bool received = co_await fetchMessageBuffer(sock, messageBuffer, lineTooLong);
+                if (!received) {
+                    if (sock.timedOut()) {
+                        co_await doError(sock, "421", fqHostname + " timeout, closing connection");
+                    }
+                    connectionActive = false;
+                    break;
+                }
+
+                if (lineTooLong) {
+                    // We won't split a line, so the whole message goes
+                    co_await doError(sock, "500", "line too long");
+                    result = 500;
+                }
+                else {
+                    MessageTrace trace;
+                    trace.heloName = heloName;
+                    trace.client = client;
+                    trace.esmtp = esmtp;
+                    trace.tls = sock.tls() != nullptr;
+                    trace.reversePath = reversePath;
+                    trace.forwardPath = forwardPath;
+                    result = co_await processMessage(sock, trace, messageBuffer);
+                }
+
+                // One line per transaction, whatever happened to it. The
+                // addresses go last, a long one only truncates itself.
+                int level = result == 250 ? LOG_INFO : LOG_WARN;
+                if (logEnabled(level)) {
+                    auto latency = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() -
+                                                                               transactionStart);
+                    logRecord(level,
+                              "event=transaction result=%d latency_ms=%lld size=%zu tls=%d client=%s from=%s to=%s",
+                              result, (long long)latency.count(), messageBuffer.length(), sock.tls() != nullptr,
+                              client.c_str(), logValue("<" + reversePath + ">").c_str(),
+                              logValue("<" + forwardPath + ">").c_str());
+                }
+
+                // The transaction is over either way, a new one starts with MAIL
+                resetState();
             }
 
             break;
+        case STARTTLS: {
+            bool hadTls = sock.tls() != nullptr;
+            connectionActive = co_await doStartTlsCommand(sock, client);
+
+            // RFC 3207: the session starts over from nothing after the
+            // handshake. A 454 leaves everything as it was.
+            if (!hadTls && sock.tls() != nullptr) {
+                resetState();
+                heloName = "";
+                esmtp = false;
+            }
+            break;
+        }
         case RSET:
             resetState();
-            doRsetCommand(sockfd);
+            co_await doRsetCommand(sock);
             break;
         case NOOP:
-            doNoopCommand(sockfd);
+            co_await doNoopCommand(sock);
             break;
         case QUIT:
-            doQuitCommand(sockfd, fqHostname);
+            co_await doQuitCommand(sock, fqHostname);
             connectionActive = false;
             break;
         default:
-            doUnknownCommand(sockfd);
+            co_await doUnknownCommand(sock);
             break;
         }
     }
 
-    close(sockfd);
+    sessionTracker.remove(sockfd);
+    sock.close();
 
-    if (DEBUG)
-        cout << "Thread terminating" << endl;
+    logRecord(LOG_DEBUG, "event=disconnect client=%s", client.c_str());
 }
 
-// ***************************************************************************
-// * Main
-// ***************************************************************************
-int main(int argc, char **argv)
+// "ip:port" of whoever is on the other end, for the log
+string getPeerName(int sockfd)
 {
+    struct sockaddr_in peer;
+    socklen_t peerLength = sizeof(peer);
+    char address[INET_ADDRSTRLEN];
 
-    if (argc != 1) {
-        cout << "usage " << argv[0] << endl;
-        exit(-1);
+    if (getpeername(sockfd, (struct sockaddr *)&peer, &peerLength) < 0 ||
+        inet_ntop(AF_INET, &peer.sin_addr, address, sizeof(address)) == nullptr) {
+        return "unknown";
     }
 
+    return string(address) + ":" + to_string(ntohs(peer.sin_port));
+}
+
+// ***************************************************************************
+// * createListenSocket()
+// *  Everything needed to get a socket accepting connections on port.
+// ***************************************************************************
+int createListenSocket(int port)
+{
     // *******************************************************************
     // * Creating the inital socket is the same as in a client.
     // ********************************************************************
     int listenfd = -1;
     if ((listenfd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        cout << "Failed to create listening socket " << strerror(errno) << endl;
-
-        exit(-1);
+        logFatal("event=socket_failed error=\"%s\"", strerror(errno));
     }
 
+    // Don't let TIME_WAIT from the last run keep us off the port
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // ********************************************************************
     // * The same address structure is used, however we use a wildcard
     // * for the IP address since we don't know who will be connecting.
@@ -243,19 +351,17 @@ int main(int argc, char **argv)
     memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = PF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(PORT);
+    servaddr.sin_port = htons(port);
 
     // ********************************************************************
     // * Binding configures the socket with the parameters we have
     // * specified in the servaddr structure.  This step is implicit in
     // * the connect() call, but must be explicitly listed for servers.
     // ********************************************************************
-    if (DEBUG)
-        cout << "Process has bound fd " << listenfd << " to port " << PORT << endl;
+    logRecord(LOG_DEBUG, "event=bind fd=%d port=%d", listenfd, port);
 
     if (bind(listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-        cout << "bind() failed: " << strerror(errno) << endl;
-        exit(-1);
+        logFatal("event=bind_failed port=%d error=\"%s\"", port, strerror(errno));
     }
 
     // ********************************************************************
@@ -263,38 +369,259 @@ int main(int argc, char **argv)
     // * needed to being accepting connections.  This creates a que for
     // * connections and starts the kernel listening for connections.
     // ********************************************************************
-    if (DEBUG)
-        cout << "We are now listening for new connections" << endl;
+    logRecord(LOG_DEBUG, "event=listen fd=%d", listenfd);
 
     int listenq = -1;
 
     if (listen(listenfd, listenq) < 0) {
-        cout << "listen() failed: " << strerror(errno) << endl;
+        logFatal("event=listen_failed port=%d error=\"%s\"", port, strerror(errno));
+    }
+
+    return listenfd;
+}
+
+// ***************************************************************************
+// * raiseFileLimit()
+// *  Every session is a descriptor, and relays and mailboxes want more.
+// *  The default soft limit of 1024 is far short of what the event loops
+// *  can carry, so take everything the hard limit allows.
+// ***************************************************************************
+void raiseFileLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return;
+    }
+    // An unlimited hard limit still stops at the kernel's nr_open
+    rlim_t target = limit.rlim_max == RLIM_INFINITY ? MAX_OPEN_FILES : limit.rlim_max;
+    if (limit.rlim_cur < target) {
+        rlim_t soft = limit.rlim_cur;
+        limit.rlim_cur = target;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            logRecord(LOG_WARN, "event=fd_limit soft=%llu error=\"%s\"", (unsigned long long)soft, strerror(errno));
+            return;
+        }
+    }
+    logRecord(LOG_DEBUG, "event=fd_limit soft=%llu", (unsigned long long)limit.rlim_cur);
+}
+
+// ***************************************************************************
+// * acceptConnections()
+// *  Hands every new connection to an event loop. Returns once we should
+// *  stop accepting: either a new build has taken over the listening
+// *  socket, or we were asked to shut down.
+// ***************************************************************************
+void acceptConnections(vector<int> const &listenfds, int upgradefd, int signalfd)
+{
+    vector<struct pollfd> pfds;
+    for (int listenfd : listenfds) {
+        pfds.push_back({listenfd, POLLIN, 0});
+    }
+    pfds.push_back({upgradefd, POLLIN, 0});
+    pfds.push_back({signalfd, POLLIN, 0});
+
+    while (1) {
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logFatal("event=poll_failed error=\"%s\"", strerror(errno));
+        }
+
+        if (pfds[pfds.size() - 1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            read(signalfd, &info, sizeof(info));
+
+            // SIGHUP swaps in a rebuilt recipient table, sessions never wait on it
+            if (info.ssi_signo == SIGHUP) {
+                if (reloadRecipientTable(RECIPIENT_DB_PATH) < 0) {
+                    logRecord(LOG_ERROR, "event=reload_failed path=%s msg=\"keeping the old table\"",
+                              RECIPIENT_DB_PATH);
+                }
+                else {
+                    logRecord(LOG_INFO, "event=reload path=%s", RECIPIENT_DB_PATH);
+                }
+                if (reloadTransportMap(TRANSPORT_MAP_PATH) < 0) {
+                    logRecord(LOG_ERROR, "event=reload_failed path=%s msg=\"keeping the old routes\"",
+                              TRANSPORT_MAP_PATH);
+                }
+                continue;
+            }
+
+            // SIGUSR1 turns debug logging on and off without a restart
+            if (info.ssi_signo == SIGUSR1) {
+                toggleDebugLogging();
+                continue;
+            }
+
+            logRecord(LOG_INFO, "event=shutdown signal=%d", info.ssi_signo);
+            return;
+        }
+
+        if (pfds[pfds.size() - 2].revents & POLLIN) {
+            if (handleUpgradeRequest(upgradefd, listenfds)) {
+                logRecord(LOG_INFO, "event=handoff msg=\"new process took over the listening socket\"");
+                return;
+            }
+        }
+
+        // ********************************************************************
+        // * When a connection request comes in the accept() call creates a
+        // * NEW socket with a new fd that will be used for the communication.
+        // * The listening sockets are non-blocking because during an upgrade
+        // * the other process may win the race for a connection.
+        // ********************************************************************
+        for (size_t i = 0; i < listenfds.size(); i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            int connfd = -1;
+            if ((connfd = accept4(listenfds[i], (struct sockaddr *)nullptr, nullptr, SOCK_CLOEXEC)) < 0) {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) {
+                    continue;
+                }
+
+                // Out of descriptors or memory: the sessions we have still
+                // deserve to finish. New ones wait in the backlog until some
+                // of those close.
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    logRecord(LOG_WARN, "event=accept_failed error=\"%s\" backoff_ms=%lld", strerror(errno),
+                              (long long)ACCEPT_BACKOFF.count());
+                    this_thread::sleep_for(ACCEPT_BACKOFF);
+                    break;
+                }
+                logFatal("event=accept_failed error=\"%s\"", strerror(errno));
+            }
+
+            spawn(ioScheduler.next(), processConnection(connfd));
+        }
+    }
+}
+
+// ***************************************************************************
+// * Main
+// *  Run with no arguments to start fresh, or with -u to take the listening
+// *  socket over from a running server and let it drain.
+// ***************************************************************************
+int main(int argc, char **argv)
+{
+    bool takeOver = false;
+    if (argc == 3 && string(argv[1]) == "-m") {
+        // postmap-style: compile the recipient source into <source>.db
+        string dbPath = string(argv[2]) + ".db";
+        if (compileRecipientTable(argv[2], dbPath) < 0) {
+            cout << "Failed to compile " << argv[2] << endl;
+            exit(-1);
+        }
+        return 0;
+    }
+    else if (argc == 2 && string(argv[1]) == "-u") {
+        takeOver = true;
+    }
+    else if (argc != 1) {
+        cout << "usage " << argv[0] << " [-u | -m <recipient source>]" << endl;
         exit(-1);
     }
 
     // ********************************************************************
-    // * The accept call will sleep, waiting for a connection.  When
-    // * a connection request comes in the accept() call creates a NEW
-    // * socket with a new fd that will be used for the communication.
+    // * Shutdown and reload signals are read from a signalfd in the accept
+    // * loop. They must be blocked before any thread starts so none of
+    // * them gets one.
     // ********************************************************************
-    set<pthread_t *> threads;
-    while (1) {
-        if (DEBUG)
-            cout << "Calling accept() in master thread." << endl;
-        int *connfd = new int(-1);
-        if ((*connfd = accept(listenfd, (struct sockaddr *)nullptr, nullptr)) < 0) {
-            cout << "Accept failed: " << strerror(errno) << endl;
-            exit(-1);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    // A peer that resets the connection shows up as EPIPE. OpenSSL writes
+    // with plain write(), which would raise SIGPIPE and kill us instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    startLogger();
+    raiseFileLimit();
+
+    // STARTTLS in both directions. Without smtp.crt/smtp.key we make up a
+    // self-signed certificate, which is all opportunistic TLS needs.
+    if (initServerTls(TLS_CERT_PATH, TLS_KEY_PATH, TLS_TICKET_KEY_PATH) < 0) {
+        logRecord(LOG_ERROR, "event=tls_disabled direction=inbound cert=%s key=%s", TLS_CERT_PATH, TLS_KEY_PATH);
+    }
+    if (initClientTls() < 0) {
+        logRecord(LOG_ERROR, "event=tls_disabled direction=outbound");
+    }
+
+    // No table is fine, we fall back to accepting anyone @localhost
+    if (reloadRecipientTable(RECIPIENT_DB_PATH) < 0) {
+        logRecord(LOG_INFO, "event=no_recipient_table path=%s msg=\"only localhost is local\"", RECIPIENT_DB_PATH);
+    }
+    if (reloadTransportMap(TRANSPORT_MAP_PATH) < 0) {
+        logFatal("event=transport_map_failed path=%s", TRANSPORT_MAP_PATH);
+    }
+
+    vector<int> listenfds;
+    int handoffConn = -1;
+    if (takeOver) {
+        if ((handoffConn = takeOverListeners(UPGRADE_SOCKET_PATH, listenfds)) < 0) {
+            logFatal("event=takeover_failed path=%s", UPGRADE_SOCKET_PATH);
         }
+    }
+    else {
+        listenfds.push_back(createListenSocket(PORT));
+    }
+
+    for (int listenfd : listenfds) {
+        int flags = fcntl(listenfd, F_GETFL, 0);
+        fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    // ********************************************************************
+    // * Sessions and relays are coroutines, so they don't get a thread of
+    // * their own. A few event loops carry all of them, and the resolver
+    // * gets a small pool since res_search() can only block.
+    // ********************************************************************
+    ioScheduler.start(thread::hardware_concurrency());
+    blockingPool.start(RESOLVER_THREADS);
+    deliveryScheduler.start([](string const &reversePath, string const &forwardPath, string const &message) {
+        return attemptToRelay(fqHostname, reversePath, forwardPath, message);
+    });
+
+    // Everything that can fail is done before the old process hears from
+    // us; if we exit before the ack it just carries on serving.
+    int upgradefd = -1;
+    if ((upgradefd = openUpgradeSocket(UPGRADE_SOCKET_PATH)) < 0) {
+        logFatal("event=upgrade_socket_failed path=%s error=\"%s\"", UPGRADE_SOCKET_PATH, strerror(errno));
+    }
 
-        if (DEBUG)
-            cout << "Spawing new thread to handled connect on fd=" << *connfd << endl;
+    if (handoffConn >= 0) {
+        write(handoffConn, &UPGRADE_ACK, 1);
+        close(handoffConn);
+    }
+
+    acceptConnections(listenfds, upgradefd, sigfd);
 
-        pthread_t *threadID = new pthread_t;
-        pthread_create(threadID, nullptr, processConnection, (void *)connfd);
-        threads.insert(threadID);
+    // ********************************************************************
+    // * Whoever is listening now, it isn't us. Let the sessions we have
+    // * finish their transactions, then go.
+    // ********************************************************************
+    for (int listenfd : listenfds) {
+        close(listenfd);
     }
+    close(upgradefd);
+
+    sessionTracker.beginDrain();
+    size_t cut = sessionTracker.waitForDrain(chrono::seconds(DRAIN_TIMEOUT));
+    logRecord(cut == 0 ? LOG_INFO : LOG_WARN, "event=drained cut_sessions=%zu", cut);
+
+    deliveryScheduler.stop();
+    ioScheduler.stop();
+    blockingPool.stop();
+    stopLogger();
+
+    return 0;
 }
 
 // Code shamelessly sourced from this StackOverflow post:
@@ -325,24 +652,52 @@ string getFqHostname()
     return fqHostname;
 }
 
-void doHelloCommand(int sockfd, string const &cmdString)
+Task<void> doHelloCommand(AsyncSocket &sock, string const &cmdString)
 {
     int hostnameStartPos = cmdString.find_first_of(' ');
     if (hostnameStartPos != string::npos) {
         string hostname = cmdString.substr(hostnameStartPos + 1);
         string message = "250 hello " + hostname + "\n";
-        write(sockfd, message.c_str(), message.length());
+
+        // EHLO gets the extension list, which for now is just STARTTLS
+        if (strncasecmp(cmdString.c_str(), "EHLO", 4) == 0 && serverTlsContext != nullptr && sock.tls() == nullptr) {
+            message = "250-hello " + hostname + "\n250 STARTTLS\n";
+        }
+        co_await sock.writeAll(message, SESSION_TIMEOUT);
     }
     else {
         string message = "501 missing argument(s)\n";
-        write(sockfd, message.c_str(), message.length());
+        co_await sock.writeAll(message, SESSION_TIMEOUT);
+    }
+}
+
+// Returns false if the session can't go on (the handshake failed)
+Task<bool> doStartTlsCommand(AsyncSocket &sock, string const &client)
+{
+    if (serverTlsContext == nullptr || sock.tls() != nullptr) {
+        co_await doError(sock, "454", "TLS not available");
+        co_return true;
+    }
+
+    co_await doSuccess(sock, "220", "ready to start TLS");
+    bool started = co_await sock.startTls(newServerTls(), TLS_HANDSHAKE_TIMEOUT);
+    if (!started) {
+        logRecord(LOG_INFO, "event=tls_failed client=%s", client.c_str());
+        co_return false;
     }
+
+    bool resumed = recordHandshake(sock.tls());
+    logRecord(LOG_DEBUG, "event=tls client=%s version=%s resumed=%d", client.c_str(), SSL_get_version(sock.tls()),
+              resumed);
+    co_return true;
 }
 
 int doMailCommand(int sockfd, string const &cmdString, string &reversePath)
 {
-    // Make sure FROM parameter exists
-    int fromPos = cmdString.find("FROM:");
+    // Make sure FROM parameter exists, in whatever case it was sent
+    string upperCmd = cmdString;
+    transform(upperCmd.begin(), upperCmd.end(), upperCmd.begin(), ::toupper);
+    int fromPos = upperCmd.find("FROM:");
     if (fromPos == string::npos) {
         return -1;
     }
@@ -372,7 +727,9 @@ int doMailCommand(int sockfd, string const &cmdString, string &reversePath)
 
 int doRcptCommand(int sockfd, string const &cmdString, string &forwardPath)
 {
-    int toPos = cmdString.find("TO:");
+    string upperCmd = cmdString;
+    transform(upperCmd.begin(), upperCmd.end(), upperCmd.begin(), ::toupper);
+    int toPos = upperCmd.find("TO:");
     if (toPos == string::npos) {
         return -1;
     }
@@ -397,354 +754,160 @@ int doRcptCommand(int sockfd, string const &cmdString, string &forwardPath)
     return 0;
 }
 
-void doRsetCommand(int sockfd)
+Task<void> doRsetCommand(AsyncSocket &sock)
 {
     string message = "250 reset ok\n";
-    write(sockfd, message.c_str(), message.length());
+    co_await sock.writeAll(message, SESSION_TIMEOUT);
 }
 
-void doNoopCommand(int sockfd)
+Task<void> doNoopCommand(AsyncSocket &sock)
 {
     string message = "250 OK\n";
-    write(sockfd, message.c_str(), message.length());
+    co_await sock.writeAll(message, SESSION_TIMEOUT);
 }
 
-void doQuitCommand(int sockfd, string const &fqHostname)
+Task<void> doQuitCommand(AsyncSocket &sock, string const &fqHostname)
 {
     string message = "221 " + fqHostname + " closing connection\n";
-    write(sockfd, message.c_str(), message.length());
+    co_await sock.writeAll(message, SESSION_TIMEOUT);
 }
 
-void doUnknownCommand(int sockfd)
+Task<void> doUnknownCommand(AsyncSocket &sock)
 {
     string message = "500 unrecognized command\n";
-    write(sockfd, message.c_str(), message.length());
+    co_await sock.writeAll(message, SESSION_TIMEOUT);
 }
 
-void doError(int sockfd, string const &errorCode, string const &errorMsg)
+Task<void> doError(AsyncSocket &sock, string const &errorCode, string const &errorMsg)
 {
     string message = errorCode + " " + errorMsg + "\n";
-    write(sockfd, message.c_str(), message.length());
+    co_await sock.writeAll(message, SESSION_TIMEOUT);
 }
 
-void doSuccess(int sockfd, string const &errorCode, string const &errorMsg)
+Task<void> doSuccess(AsyncSocket &sock, string const &errorCode, string const &errorMsg)
 {
     string message = errorCode + " " + errorMsg + '\n';
-    write(sockfd, message.c_str(), message.length());
+    co_await sock.writeAll(message, SESSION_TIMEOUT);
 }
 
-void fetchMessageBuffer(int sockfd, string &msgBuffer)
+// Reads the message body up to the lone "." line, undoing the dot
+// stuffing (RFC 5321 4.5.2). Returns false if the client disconnects or
+// times out before finishing it. A line over MAX_DATA_LINE is read past
+// and sets lineTooLong; the message is no good after that.
+Task<bool> fetchMessageBuffer(AsyncSocket &sock, string &msgBuffer, bool &lineTooLong)
 {
-    bool keepGoing = true;
-
-    char readBuffer[1024];
-    while (keepGoing) {
-        memset(&readBuffer, 0, 1024);
-        int length = read(sockfd, readBuffer, 1024);
-        if (length >= 0) {
-            readBuffer[length] = '\0';
+    string line;
+    while (true) {
+        bool received = co_await sock.readLine(line, MAX_DATA_LINE, SESSION_TIMEOUT);
+        if (!received) {
+            co_return false;
         }
-
-        if (trim_val(string(readBuffer)) != ".") {
-            msgBuffer += string(readBuffer);
+        if (line == "." && !sock.lineTooLong()) {
+            co_return true;
+        }
+        if (sock.lineTooLong()) {
+            lineTooLong = true;
+            msgBuffer.clear();
         }
-        else {
-            keepGoing = false;
+        if (lineTooLong) {
+            continue;
         }
+        msgBuffer.append(line, !line.empty() && line[0] == '.' ? 1 : 0);
+        msgBuffer += "\r\n";
     }
 }
 
-void processMessage(int sockfd, string const &reversePath, string const &forwardPath, string const &message)
+// Deliver or relay the message and answer the client. Returns the reply
+// code we sent, for the transaction log.
+Task<int> processMessage(AsyncSocket &sock, MessageTrace const &trace, string const &message)
 {
     int result = -1;
-    if (isLocalRecipient(forwardPath)) {
-        result = writeToLocalFilesystem(reversePath, forwardPath, message);
-
-        if (result != 0) {
-            doError(sockfd, "451", "Local error in processing");
-        }
-        else {
-            doSuccess(sockfd, "250", "OK");
-        }
+    string mailbox;
+    int recipient = lookupRecipient(trace.forwardPath, mailbox);
+    if (recipient == RECIPIENT_UNKNOWN) {
+        // The table was reloaded since RCPT and this user is gone
+        co_await doError(sock, "550", "no such user here");
+        co_return 550;
     }
-    else {
-        result = attemptToRelay(reversePath, forwardPath, message);
+    else if (recipient == RECIPIENT_LOCAL) {
+        // Disk writes can stall, keep them off the event loop
+        co_await offload([&]() { result = writeToLocalFilesystem(trace, mailbox, message); });
 
         if (result != 0) {
-            doError(sockfd, "554", "unable to relay successfully");
-        }
-        else {
-            doSuccess(sockfd, "250", "OK");
+            co_await doError(sock, "451", "Local error in processing");
+            co_return 451;
         }
     }
-}
-
-int writeToLocalFilesystem(const string &reversePath, const string &forwardPath, const string &message)
-{
-    // Get username@hostname
-    int atSignPos = forwardPath.find('@');
-    if (atSignPos == string::npos) {
-        return -1;
-    }
-
-    string username = forwardPath.substr(0, atSignPos);
-    // Create or open in append file 'username'
-    fstream f(username, ios_base::out | ios_base::app);
-    if (DEBUG) {
-        cout << "Creating or opening file with name " << username << endl;
-    }
-    // Generate timestamp
-    time_t rawtime;
-    struct tm *timeInfo;
-    char timestamp[80];
-
-    time(&rawtime);
-    timeInfo = localtime(&rawtime);
-
-    strftime(timestamp, 80, "%c", timeInfo);
-    string headerTimestamp = string(timestamp);
-
-    strftime(timestamp, 80, "%a, %d %b %Y %T %z", timeInfo);
-    string dateTimestamp = string(timestamp);
-
-    // Dump message buffer into file 'username'
-    f << "From " << reversePath << " " << headerTimestamp << endl;
-    f << "Date: " << dateTimestamp << endl;
-    f << message << endl;
-    f << endl;
-    f.close();
-
-    // Return success or failure
-    return 0;
-}
-
-// TODO: Error handling mid-relay
-int attemptToRelay(const string &reversePath, const string &forwardPath, const string &mailMessage)
-{
-    int atSignPos = forwardPath.find('@');
-    if (atSignPos == string::npos) {
-        return -1;
-    }
-
-    string hostname = forwardPath.substr(atSignPos + 1);
-
-    // Look up MX record
-    string mxHostname;
-    if (getMxRecord(hostname, mxHostname) < 0) {
-        return -1;
-    }
-
-    if (DEBUG) {
-        cout << "Got MX record" << mxHostname << endl;
-    }
-
-    // Create client-socket connection to MTA
-    // Step 1
-    int lfd = -1;
-    if ((lfd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
-    }
-
-    if (DEBUG) {
-        cout << "Created a client-socket of fd = " << lfd << endl;
-    }
-
-    // Step 2
-    struct sockaddr_in clientaddr;
-    struct hostent *server;
-
-    server = gethostbyname(mxHostname.c_str());
-
-    memset(&clientaddr, 0, sizeof(clientaddr));
-
-    clientaddr.sin_family = PF_INET;
-    memcpy((char *)&clientaddr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
-    clientaddr.sin_port = htons(SMTP_PORT);
-
-    // Step 3
-    if (connect(lfd, (sockaddr *)&clientaddr, sizeof(clientaddr)) < 0) {
-        if (DEBUG) {
-            cout << strerror(errno) << endl;
+    else {
+        // Every hop adds its Received: line (RFC 5321 4.4)
+        string relayed;
+        relayed.reserve(message.length() + 256);
+        appendReceived(relayed, trace, fqHostname);
+        relayed += message;
+
+        // Queued behind other mail for the same domain, see delivery.hpp
+        result = co_await deliveryScheduler.deliver(trace.reversePath, trace.forwardPath, relayed);
+
+        if (relayTransient(result)) {
+            co_await doError(sock, "451", "destination busy, try again later");
+            co_return 451;
         }
-        return -1;
-    }
-
-    if (DEBUG) {
-        cout << "Connected on fd = " << lfd << endl;
-    }
-
-    // Relay commands, check for errors - read & write to the file descriptor
-    string message;
-    string replyStr;
-    char reply[1024];
-    int len = -1;
-
-    auto quitRemote = [&]() {
-        // Write QUIT
-        message = "QUIT\r\n";
-        write(lfd, message.c_str(), message.length());
-        // Read response
-        len = read(lfd, reply, 1023);
-        if (len >= 0) {
-            reply[len] = '\0';
+        else if (result != RELAY_OK) {
+            co_await doError(sock, "554", "unable to relay successfully");
+            co_return 554;
         }
-
-        // Close socket
-        close(lfd);
-    };
-
-    // Read connection message first
-    len = read(lfd, reply, 1023);
-    if (len >= 0) {
-        reply[len] = '\0';
-    }
-    replyStr = reply;
-    if (replyStr.substr(0, 3) != "220") {
-        quitRemote();
-        return -1;
-    }
-
-    // Write EHLO
-    message = "HELO " + fqHostname + "\r\n";
-    write(lfd, message.c_str(), message.length());
-
-    // Read response
-    len = read(lfd, reply, 1023);
-    if (len >= 0) {
-        reply[len] = '\0';
-    }
-    replyStr = reply;
-    if (replyStr.substr(0, 3) != "250") {
-        quitRemote();
-        return -1;
-    }
-
-    // Write MAIL FROM:<>
-    message = "MAIL FROM:<" + reversePath + ">\r\n";
-    write(lfd, message.c_str(), message.length());
-    // Read response
-    len = read(lfd, reply, 1023);
-    if (len >= 0) {
-        reply[len] = '\0';
-    }
-    replyStr = reply;
-    if (replyStr.substr(0, 3) != "250") {
-        quitRemote();
-        return -1;
-    }
-
-    // Write RCPT TO:<>
-    message = "RCPT TO:<" + forwardPath + ">\r\n";
-    write(lfd, message.c_str(), message.length());
-    // Read response
-    len = read(lfd, reply, 1023);
-    if (len >= 0) {
-        reply[len] = '\0';
-    }
-    replyStr = reply;
-    if (replyStr.substr(0, 3) != "250" && replyStr.substr(0, 3) != "251") {
-        quitRemote();
-        return -1;
-    }
-
-    // Write DATA
-    message = "DATA\r\n";
-    write(lfd, message.c_str(), message.length());
-    // Read response
-    len = read(lfd, reply, 1023);
-    if (len >= 0) {
-        reply[len] = '\0';
-    }
-    replyStr = reply;
-    if (replyStr.substr(0, 3) != "354") {
-        quitRemote();
-        return -1;
     }
 
-    // Write message
-    message = mailMessage + ".\r\n";
-    write(lfd, message.c_str(), message.length());
-    // Read response
-    len = read(lfd, reply, 1023);
-    if (len >= 0) {
-        reply[len] = '\0';
-    }
-    replyStr = reply;
-    if (replyStr.substr(0, 3) != "250") {
-        quitRemote();
-        return -1;
-    }
-
-    quitRemote();
-
-    // Return success
-    return 0;
+    co_await doSuccess(sock, "250", "OK");
+    co_return 250;
 }
 
-bool isLocalRecipient(string const &forwardPath)
+int writeToLocalFilesystem(MessageTrace const &trace, const string &mailbox, const string &message)
 {
-    int atSignPos = forwardPath.find('@');
-
-    string hostname = forwardPath.substr(atSignPos + 1);
-
-    if (hostname != "localhost") {
-        return false;
-    }
-
-    return true;
-}
-
-int getMxRecord(string const &hostname, string &mxResult)
-{
-    // Lookup MX record for hostname
-    // Comes from: http://stackoverflow.com/questions/1688432/querying-mx-record-in-c-linux
-    // I figured it was fine to look this up on SO because we didn't explicitly cover this in class
-    int limit = 1;
-    unsigned char response[NS_PACKETSZ];
-    ns_msg handle;
-    ns_rr rr;
-    int mx_index, ns_index, len;
-    char dispbuf[4096];
-
-    if ((len = res_search(hostname.c_str(), C_IN, T_MX, response, sizeof(response))) < 0) {
-        return -1;
-    }
-
-    if (ns_initparse(response, len, &handle) < 0) {
-        return -1;
-    }
-
-    len = ns_msg_count(handle, ns_s_an);
-    if (len < 0) {
+    // The whole mbox entry, trace headers and all, built in one pass
+    string entry;
+    buildMailboxEntry(entry, trace, fqHostname, message);
+
+    // Create or open in append file 'mailbox', lookupRecipient() already
+    // made sure it is a plain file name
+    int fd = open(mailbox.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
         return -1;
     }
+    logRecord(LOG_DEBUG, "event=deliver mailbox=%s", mailbox.c_str());
 
-    for (mx_index = 0, ns_index = 0; mx_index < limit && ns_index < len; ns_index++) {
-        if (ns_parserr(&handle, ns_s_an, ns_index, &rr)) {
+    // One write per message, so with O_APPEND two deliveries to the same
+    // mailbox can't end up interleaved
+    size_t offset = 0;
+    while (offset < entry.length()) {
+        ssize_t len = write(fd, entry.data() + offset, entry.length() - offset);
+        if (len < 0 && errno == EINTR) {
             continue;
         }
-        ns_sprintrr(&handle, &rr, NULL, NULL, dispbuf, sizeof(dispbuf));
-        if (ns_rr_class(rr) == ns_c_in && ns_rr_type(rr) == ns_t_mx) {
-            char mxname[MAXDNAME];
-            dn_expand(ns_msg_base(handle), ns_msg_base(handle) + ns_msg_size(handle), ns_rr_rdata(rr) + NS_INT16SZ,
-                      mxname, sizeof(mxname));
-            mxResult = strdup(mxname);
+        if (len <= 0) {
+            close(fd);
+            return -1;
         }
+        offset += len;
     }
 
-    return 0;
+    // Return success or failure
+    return close(fd) == 0 ? 0 : -1;
 }
 
+// not1(ptr_fun(...)) is gone in C++20, a plain predicate does the same job
+static bool isNotSpace(unsigned char c) { return !isspace(c); }
+
 string trim_ref(string &s)
 {
-    s.erase(s.begin(), find_if(s.begin(), s.end(), not1(ptr_fun<int, int>(isspace))));
-    s.erase(find_if(s.rbegin(), s.rend(), not1(ptr_fun<int, int>(isspace))).base(), s.end());
+    s.erase(s.begin(), find_if(s.begin(), s.end(), isNotSpace));
+    s.erase(find_if(s.rbegin(), s.rend(), isNotSpace).base(), s.end());
     return s;
 }
 
 string trim_val(string s)
 {
-    s.erase(s.begin(), find_if(s.begin(), s.end(), not1(ptr_fun<int, int>(isspace))));
-    s.erase(find_if(s.rbegin(), s.rend(), not1(ptr_fun<int, int>(isspace))).base(), s.end());
+    s.erase(s.begin(), find_if(s.begin(), s.end(), isNotSpace));
+    s.erase(find_if(s.rbegin(), s.rend(), isNotSpace).base(), s.end());
     return s;
 }
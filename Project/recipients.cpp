@@ -0,0 +1,308 @@
+#include "recipients.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+const static char RECIPIENT_MAGIC[8] = {'S', 'M', 'T', 'P', 'R', 'C', 'P', 'T'};
+const static uint32_t RECIPIENT_VERSION = 1;
+
+// A retired table stays mapped this long after the swap. Lookups never
+// suspend while holding a table, so this is far more than any of them needs.
+const static int RETIRE_GRACE_SECONDS = 30;
+
+static atomic<RecipientTable *> activeTable{nullptr};
+static vector<pair<RecipientTable *, chrono::steady_clock::time_point>> retiredTables;
+
+// FNV-1a, 64 bit. Zero is kept free so an empty bucket can't match.
+static uint64_t hashKey(string const &key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+static string lowercase(string s)
+{
+    transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return tolower(c); });
+    return s;
+}
+
+// ***************************************************************************
+// * RecipientTable
+// ***************************************************************************
+RecipientTable *RecipientTable::open(string const &path)
+{
+    int fd = -1;
+    if ((fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(RecipientTableHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+
+    RecipientTable *table = new RecipientTable();
+    table->base = base;
+    table->length = info.st_size;
+    table->header = (RecipientTableHeader const *)base;
+
+    // Check everything once here so lookup() never has to
+    RecipientTableHeader const *header = table->header;
+    size_t bucketBytes = (size_t)header->bucketCount * sizeof(RecipientBucket);
+    if (memcmp(header->magic, RECIPIENT_MAGIC, sizeof(RECIPIENT_MAGIC)) != 0 || header->version != RECIPIENT_VERSION ||
+        header->bucketCount == 0 || (header->bucketCount & (header->bucketCount - 1)) != 0 ||
+        sizeof(RecipientTableHeader) + bucketBytes > table->length) {
+        delete table;
+        return nullptr;
+    }
+
+    table->buckets = (RecipientBucket const *)((char const *)base + sizeof(RecipientTableHeader));
+    table->strings = (char const *)base + sizeof(RecipientTableHeader) + bucketBytes;
+    size_t stringBytes = table->length - sizeof(RecipientTableHeader) - bucketBytes;
+
+    bool hasEmptyBucket = false;
+    for (uint32_t i = 0; i < header->bucketCount; i++) {
+        RecipientBucket const &bucket = table->buckets[i];
+        if (bucket.hash == 0) {
+            hasEmptyBucket = true;
+            continue;
+        }
+        if ((size_t)bucket.keyOffset + bucket.keyLength > stringBytes ||
+            (size_t)bucket.valueOffset + bucket.valueLength > stringBytes) {
+            delete table;
+            return nullptr;
+        }
+    }
+
+    // Probing stops at an empty bucket, so there has to be one
+    if (!hasEmptyBucket) {
+        delete table;
+        return nullptr;
+    }
+
+    return table;
+}
+
+RecipientTable::~RecipientTable()
+{
+    if (base != nullptr) {
+        munmap(base, length);
+    }
+}
+
+bool RecipientTable::lookup(string const &key, string &value) const
+{
+    uint64_t hash = hashKey(key);
+    uint32_t mask = header->bucketCount - 1;
+
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        RecipientBucket const &bucket = buckets[i];
+        if (bucket.hash == 0) {
+            return false;
+        }
+        if (bucket.hash == hash && bucket.keyLength == key.length() &&
+            memcmp(strings + bucket.keyOffset, key.data(), key.length()) == 0) {
+            value.assign(strings + bucket.valueOffset, bucket.valueLength);
+            return true;
+        }
+    }
+}
+
+// ***************************************************************************
+// * compileRecipientTable()
+// *  Parse the text source and write the hashed table next to it. The file
+// *  is written under a temporary name and renamed into place, so a running
+// *  server only ever maps a complete table.
+// ***************************************************************************
+int compileRecipientTable(string const &sourcePath, string const &dbPath)
+{
+    ifstream source(sourcePath);
+    if (!source) {
+        return -1;
+    }
+
+    vector<pair<string, string>> entries;
+    string line;
+    while (getline(source, line)) {
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.erase(comment);
+        }
+
+        istringstream fields(line);
+        string key, value;
+        if (!(fields >> key)) {
+            continue;
+        }
+        fields >> value;
+        key = lowercase(key);
+
+        size_t atSignPos = key.find('@');
+        if (atSignPos == string::npos || atSignPos == key.length() - 1) {
+            fprintf(stderr, "%s: '%s' is not @domain or user@domain\n", sourcePath.c_str(), key.c_str());
+            return -1;
+        }
+
+        // Users default to a mailbox named after their local part
+        if (atSignPos > 0 && value.empty()) {
+            value = key.substr(0, atSignPos);
+        }
+
+        // Mailbox names become file names, keep them in this directory
+        if (atSignPos > 0 && (value.find('/') != string::npos || value[0] == '.')) {
+            fprintf(stderr, "%s: mailbox '%s' is not a plain file name\n", sourcePath.c_str(), value.c_str());
+            return -1;
+        }
+
+        // A user makes its domain local too, so it needn't be listed twice
+        if (atSignPos > 0) {
+            entries.push_back(make_pair(key.substr(atSignPos), string()));
+        }
+        entries.push_back(make_pair(key, value));
+    }
+
+    uint32_t bucketCount = 2;
+    while (bucketCount < entries.size() * 2) {
+        bucketCount *= 2;
+    }
+
+    vector<RecipientBucket> buckets(bucketCount);
+    memset(buckets.data(), 0, bucketCount * sizeof(RecipientBucket));
+    string strings;
+    uint32_t entryCount = 0;
+
+    for (auto &entry : entries) {
+        uint64_t hash = hashKey(entry.first);
+        uint32_t i = hash & (bucketCount - 1);
+        while (buckets[i].hash != 0 && !(buckets[i].hash == hash && buckets[i].keyLength == entry.first.length() &&
+                                         strings.compare(buckets[i].keyOffset, buckets[i].keyLength, entry.first) == 0)) {
+            i = (i + 1) & (bucketCount - 1);
+        }
+
+        // Later lines override earlier ones, like postmap
+        if (buckets[i].hash == 0) {
+            entryCount++;
+        }
+        buckets[i].hash = hash;
+        buckets[i].keyOffset = strings.length();
+        buckets[i].keyLength = entry.first.length();
+        strings += entry.first;
+        buckets[i].valueOffset = strings.length();
+        buckets[i].valueLength = entry.second.length();
+        strings += entry.second;
+    }
+
+    RecipientTableHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECIPIENT_MAGIC, sizeof(RECIPIENT_MAGIC));
+    header.version = RECIPIENT_VERSION;
+    header.bucketCount = bucketCount;
+    header.entryCount = entryCount;
+
+    string tempPath = dbPath + ".tmp";
+    ofstream db(tempPath, ios_base::out | ios_base::binary | ios_base::trunc);
+    db.write((char const *)&header, sizeof(header));
+    db.write((char const *)buckets.data(), bucketCount * sizeof(RecipientBucket));
+    db.write(strings.data(), strings.length());
+    db.close();
+
+    if (!db || rename(tempPath.c_str(), dbPath.c_str()) < 0) {
+        unlink(tempPath.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+// ***************************************************************************
+// * reloadRecipientTable()
+// *  Map dbPath and make it the table every new lookup sees. Only the main
+// *  thread calls this. If the file is missing or bad the old table stays.
+// ***************************************************************************
+int reloadRecipientTable(string const &dbPath)
+{
+    RecipientTable *table = RecipientTable::open(dbPath);
+    if (table == nullptr) {
+        return -1;
+    }
+
+    auto now = chrono::steady_clock::now();
+    retiredTables.erase(remove_if(retiredTables.begin(), retiredTables.end(),
+                                  [&](pair<RecipientTable *, chrono::steady_clock::time_point> const &retired) {
+                                      if (now - retired.second < chrono::seconds(RETIRE_GRACE_SECONDS)) {
+                                          return false;
+                                      }
+                                      delete retired.first;
+                                      return true;
+                                  }),
+                        retiredTables.end());
+
+    RecipientTable *old = activeTable.exchange(table, memory_order_acq_rel);
+    if (old != nullptr) {
+        retiredTables.push_back(make_pair(old, now));
+    }
+
+    return 0;
+}
+
+// ***************************************************************************
+// * lookupRecipient()
+// *  RECIPIENT_LOCAL (mailbox filled in), RECIPIENT_UNKNOWN for a local
+// *  domain without that user, or RECIPIENT_REMOTE. Without a table only
+// *  "localhost" is local and every user there exists, as before.
+// ***************************************************************************
+int lookupRecipient(string const &forwardPath, string &mailbox)
+{
+    size_t atSignPos = forwardPath.find('@');
+    if (atSignPos == string::npos) {
+        return RECIPIENT_REMOTE;
+    }
+
+    string address = lowercase(forwardPath);
+    string domain = address.substr(atSignPos);
+
+    RecipientTable const *table = activeTable.load(memory_order_acquire);
+    if (table == nullptr) {
+        if (domain != "@localhost") {
+            return RECIPIENT_REMOTE;
+        }
+        mailbox = forwardPath.substr(0, atSignPos);
+        if (mailbox.empty() || mailbox.find('/') != string::npos || mailbox[0] == '.') {
+            return RECIPIENT_UNKNOWN;
+        }
+        return RECIPIENT_LOCAL;
+    }
+
+    string unused;
+    if (!table->lookup(domain, unused)) {
+        return RECIPIENT_REMOTE;
+    }
+    // "<@localhost>" would find the domain's own key, which has no mailbox
+    if (atSignPos == 0 || !table->lookup(address, mailbox) || mailbox.empty()) {
+        return RECIPIENT_UNKNOWN;
+    }
+
+    return RECIPIENT_LOCAL;
+}
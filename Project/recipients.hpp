@@ -0,0 +1,66 @@
+#ifndef __RECIPIENTS_HPP_
+#define __RECIPIENTS_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// ************************************************************************
+// * Recipient table
+// *  The text source lists local domains and users, postmap style:
+// *
+// *      @localhost                 # a local domain
+// *      bob@localhost              # mailbox "bob"
+// *      postmaster@localhost  bob  # alias, delivered to mailbox "bob"
+// *
+// *  "./project1 -m recipients" compiles it into recipients.db, an open
+// *  addressing hash table laid out so it can be mmap'd and probed in
+// *  place. Sessions look things up without taking any lock; a reload
+// *  maps the new file and swaps one pointer.
+// ************************************************************************
+const static int RECIPIENT_REMOTE = 0;
+const static int RECIPIENT_LOCAL = 1;
+const static int RECIPIENT_UNKNOWN = 2;
+
+struct RecipientTableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucketCount;
+    uint32_t entryCount;
+    uint32_t reserved;
+};
+
+struct RecipientBucket {
+    uint64_t hash;
+    uint32_t keyOffset;
+    uint32_t keyLength;
+    uint32_t valueOffset;
+    uint32_t valueLength;
+};
+
+class RecipientTable {
+public:
+    // Maps and validates path. Returns nullptr if it isn't a usable table.
+    static RecipientTable *open(string const &path);
+    ~RecipientTable();
+
+    bool lookup(string const &key, string &value) const;
+    uint32_t size() const { return header->entryCount; }
+
+private:
+    RecipientTable() = default;
+
+    void *base = nullptr;
+    size_t length = 0;
+    RecipientTableHeader const *header = nullptr;
+    RecipientBucket const *buckets = nullptr;
+    char const *strings = nullptr;
+};
+
+int compileRecipientTable(string const &sourcePath, string const &dbPath);
+int reloadRecipientTable(string const &dbPath);
+int lookupRecipient(string const &forwardPath, string &mailbox);
+
+#endif
@@ -0,0 +1,376 @@
+#include "relay.hpp"
+#include "log.hpp"
+#include "tls.hpp"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+const static int MAX_REPLY_LINE = 1024;
+
+static mutex transportLock;
+static unordered_map<string, pair<string, int>> transportMap;
+
+// ***************************************************************************
+// * relayCommand()
+// *  Send one command to the remote MTA and return the three digit code of
+// *  its reply, following multi-line (250-...) replies to the last line.
+// *  If reply is given every line is appended to it. An empty code means
+// *  the connection broke, or the remote said nothing for timeout.
+// ***************************************************************************
+Task<string> relayCommand(AsyncSocket &lfd, string const &message, chrono::milliseconds timeout, string *reply)
+{
+    if (!message.empty()) {
+        bool sent = co_await lfd.writeAll(message, timeout);
+        if (!sent) {
+            co_return "";
+        }
+    }
+
+    string replyStr;
+    do {
+        bool received = co_await lfd.readLine(replyStr, MAX_REPLY_LINE, timeout);
+        if (!received) {
+            co_return "";
+        }
+        if (reply != nullptr) {
+            *reply += replyStr + "\n";
+        }
+    } while (replyStr.length() > 3 && replyStr[3] == '-');
+
+    co_return replyStr.substr(0, 3);
+}
+
+Task<void> quitRemote(AsyncSocket &lfd)
+{
+    // Write QUIT and read the response, we don't care what it says. A
+    // remote that just let us time out doesn't get to make us wait again.
+    if (!lfd.timedOut()) {
+        co_await relayCommand(lfd, "QUIT\r\n", RELAY_QUIT_TIMEOUT);
+    }
+
+    // Close socket
+    lfd.close();
+}
+
+// Looks for an EHLO keyword, each one is on its own "250-KEYWORD ..." line
+static bool hasExtension(string const &ehloReply, string const &keyword)
+{
+    size_t lineStart = 0;
+    while (lineStart < ehloReply.length()) {
+        size_t lineEnd = ehloReply.find('\n', lineStart);
+        if (lineEnd == string::npos) {
+            lineEnd = ehloReply.length();
+        }
+        if (lineEnd - lineStart > 4 && ehloReply.compare(lineStart + 4, keyword.length(), keyword) == 0) {
+            return true;
+        }
+        lineStart = lineEnd + 1;
+    }
+    return false;
+}
+
+// Lines that start with '.' get another one in front (RFC 5321 4.5.2),
+// so none of them can end the message early
+static string dotStuff(string const &message)
+{
+    string stuffed;
+    stuffed.reserve(message.length() + 2);
+
+    size_t lineStart = 0;
+    while (lineStart < message.length()) {
+        size_t lineEnd = message.find('\n', lineStart);
+        lineEnd = lineEnd == string::npos ? message.length() : lineEnd + 1;
+        if (message[lineStart] == '.') {
+            stuffed += '.';
+        }
+        stuffed.append(message, lineStart, lineEnd - lineStart);
+        lineStart = lineEnd;
+    }
+
+    return stuffed;
+}
+
+// The remote said no: hand its reply code back so the caller can tell a
+// "try later" from a "never". No reply at all is a "try later" too.
+static int refused(string const &code)
+{
+    if (code.empty()) {
+        return RELAY_BROKEN;
+    }
+    int reply = atoi(code.c_str());
+    return reply >= 400 ? reply : RELAY_FAILED;
+}
+
+Task<int> relayMessage(AsyncSocket &lfd, string const &peerName, string const &heloName, string const &reversePath,
+                       string const &forwardPath, string const &mailMessage)
+{
+    // Relay commands, check for errors - read & write to the socket
+    string code;
+
+    // Read connection message first
+    code = co_await relayCommand(lfd, "", RELAY_GREETING_TIMEOUT);
+    if (code != "220") {
+        co_await quitRemote(lfd);
+        co_return refused(code);
+    }
+
+    // Write EHLO, falling back to HELO for servers that don't know it
+    string ehloReply;
+    code = co_await relayCommand(lfd, "EHLO " + heloName + "\r\n", RELAY_COMMAND_TIMEOUT, &ehloReply);
+    if (code != "250") {
+        code = co_await relayCommand(lfd, "HELO " + heloName + "\r\n", RELAY_COMMAND_TIMEOUT);
+        if (code != "250") {
+            co_await quitRemote(lfd);
+            co_return refused(code);
+        }
+    }
+    else if (clientTlsContext != nullptr && hasExtension(ehloReply, "STARTTLS")) {
+        // Opportunistic: if STARTTLS is refused we carry on in the clear,
+        // but a handshake that fails halfway leaves nothing to carry on with
+        code = co_await relayCommand(lfd, "STARTTLS\r\n", RELAY_COMMAND_TIMEOUT);
+        if (code == "220") {
+            bool secured = co_await lfd.startTls(newClientTls(peerName), RELAY_TLS_TIMEOUT);
+            if (!secured) {
+                logRecord(LOG_WARN, "event=relay_tls_failed mx=%s timeout=%d", peerName.c_str(), lfd.timedOut());
+                lfd.close();
+                co_return RELAY_BROKEN;
+            }
+            bool resumed = recordHandshake(lfd.tls());
+            logRecord(LOG_DEBUG, "event=relay_tls mx=%s resumed=%d", peerName.c_str(), resumed);
+
+            // Everything learned before the handshake is void, start over
+            code = co_await relayCommand(lfd, "EHLO " + heloName + "\r\n", RELAY_COMMAND_TIMEOUT);
+            if (code != "250") {
+                co_await quitRemote(lfd);
+                co_return refused(code);
+            }
+        }
+    }
+
+    // Write MAIL FROM:<>
+    code = co_await relayCommand(lfd, "MAIL FROM:<" + reversePath + ">\r\n", RELAY_COMMAND_TIMEOUT);
+    if (code != "250") {
+        co_await quitRemote(lfd);
+        co_return refused(code);
+    }
+
+    // Write RCPT TO:<>
+    code = co_await relayCommand(lfd, "RCPT TO:<" + forwardPath + ">\r\n", RELAY_COMMAND_TIMEOUT);
+    if (code != "250" && code != "251") {
+        co_await quitRemote(lfd);
+        co_return refused(code);
+    }
+
+    // Write DATA
+    code = co_await relayCommand(lfd, "DATA\r\n", RELAY_DATA_INIT_TIMEOUT);
+    if (code != "354") {
+        co_await quitRemote(lfd);
+        co_return refused(code);
+    }
+
+    // Write message, then give the remote its time to take it in
+    code = "";
+    bool sent = co_await lfd.writeAll(dotStuff(mailMessage) + ".\r\n", RELAY_DATA_BLOCK_TIMEOUT);
+    if (sent) {
+        code = co_await relayCommand(lfd, "", RELAY_DATA_END_TIMEOUT);
+    }
+    if (code != "250") {
+        co_await quitRemote(lfd);
+        co_return refused(code);
+    }
+
+    co_await quitRemote(lfd);
+
+    // Return success
+    co_return RELAY_OK;
+}
+
+// ***************************************************************************
+// * attemptToRelay()
+// *  Find the MX for the recipient's domain (or its transport map route),
+// *  connect, and hand over to relayMessage() for the SMTP dialogue. The
+// *  delivery scheduler calls this, nothing else should.
+// ***************************************************************************
+Task<int> attemptToRelay(string const &heloName, string const &reversePath, string const &forwardPath,
+                         string const &mailMessage)
+{
+    int atSignPos = forwardPath.find('@');
+    if (atSignPos == string::npos) {
+        co_return RELAY_FAILED;
+    }
+
+    string hostname = forwardPath.substr(atSignPos + 1);
+
+    // Look up MX record and its address, the resolver only knows how to block
+    string mxHostname;
+    int port = SMTP_PORT;
+    struct sockaddr_in clientaddr;
+    int result = -1;
+
+    bool routed = lookupTransport(hostname, mxHostname, port);
+    co_await offload([&]() {
+        if (routed || getMxRecord(hostname, mxHostname) == 0) {
+            result = getHostAddress(mxHostname, clientaddr);
+        }
+    });
+    if (result < 0) {
+        co_return RELAY_FAILED;
+    }
+
+    logRecord(LOG_DEBUG, "event=mx domain=%s mx=%s", hostname.c_str(), mxHostname.c_str());
+
+    // Create client-socket connection to MTA
+    // Step 1
+    int fd = -1;
+    if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        co_return RELAY_UNREACHABLE;
+    }
+    AsyncSocket lfd(fd);
+
+    // Step 2
+    clientaddr.sin_port = htons(port);
+
+    // Step 3
+    int connected = co_await lfd.connectTo((sockaddr *)&clientaddr, sizeof(clientaddr), RELAY_CONNECT_TIMEOUT);
+    if (connected < 0) {
+        logRecord(LOG_WARN, "event=relay_connect_failed mx=%s error=\"%s\"", mxHostname.c_str(), strerror(errno));
+        co_return RELAY_UNREACHABLE;
+    }
+
+    logRecord(LOG_DEBUG, "event=relay_connected mx=%s fd=%d", mxHostname.c_str(), fd);
+
+    co_return co_await relayMessage(lfd, mxHostname, heloName, reversePath, forwardPath, mailMessage);
+}
+
+int getMxRecord(string const &hostname, string &mxResult)
+{
+    // Lookup MX record for hostname
+    // Comes from: http://stackoverflow.com/questions/1688432/querying-mx-record-in-c-linux
+    // I figured it was fine to look this up on SO because we didn't explicitly cover this in class
+    int limit = 1;
+    unsigned char response[NS_PACKETSZ];
+    ns_msg handle;
+    ns_rr rr;
+    int mx_index, ns_index, len;
+    char dispbuf[4096];
+
+    if ((len = res_search(hostname.c_str(), C_IN, T_MX, response, sizeof(response))) < 0) {
+        return -1;
+    }
+
+    if (ns_initparse(response, len, &handle) < 0) {
+        return -1;
+    }
+
+    len = ns_msg_count(handle, ns_s_an);
+    if (len < 0) {
+        return -1;
+    }
+
+    // No MX record means the domain itself is the mail host (RFC 5321 5.1)
+    mxResult = hostname;
+
+    for (mx_index = 0, ns_index = 0; mx_index < limit && ns_index < len; ns_index++) {
+        if (ns_parserr(&handle, ns_s_an, ns_index, &rr)) {
+            continue;
+        }
+        ns_sprintrr(&handle, &rr, NULL, NULL, dispbuf, sizeof(dispbuf));
+        if (ns_rr_class(rr) == ns_c_in && ns_rr_type(rr) == ns_t_mx) {
+            char mxname[MAXDNAME];
+            dn_expand(ns_msg_base(handle), ns_msg_base(handle) + ns_msg_size(handle), ns_rr_rdata(rr) + NS_INT16SZ,
+                      mxname, sizeof(mxname));
+            mxResult = string(mxname);
+            mx_index++;
+        }
+    }
+
+    return 0;
+}
+
+// Thread-safe replacement for gethostbyname(), fills in the IPv4 address only
+int getHostAddress(string const &hostname, struct sockaddr_in &addr)
+{
+    struct addrinfo hints, *info;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = PF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(hostname.c_str(), nullptr, &hints, &info) != 0) {
+        return -1;
+    }
+
+    memcpy(&addr, info->ai_addr, sizeof(addr));
+    freeaddrinfo(info);
+
+    return 0;
+}
+
+// ***************************************************************************
+// * reloadTransportMap()
+// *  Read the routes in path and replace the old ones. A missing file just
+// *  means no routes. Returns -1 if a line doesn't parse, and keeps the
+// *  old routes in that case.
+// ***************************************************************************
+int reloadTransportMap(string const &path)
+{
+    unordered_map<string, pair<string, int>> routes;
+
+    ifstream source(path);
+    string line;
+    while (getline(source, line)) {
+        line = line.substr(0, line.find('#'));
+
+        string domain, target;
+        istringstream fields(line);
+        if (!(fields >> domain)) {
+            continue;
+        }
+
+        size_t colon = string::npos;
+        if (!(fields >> target) || (colon = target.rfind(':')) == string::npos || colon == 0) {
+            logRecord(LOG_ERROR, "event=transport_bad_line path=%s line=\"%s\"", path.c_str(), line.c_str());
+            return -1;
+        }
+
+        int port = atoi(target.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) {
+            logRecord(LOG_ERROR, "event=transport_bad_line path=%s line=\"%s\"", path.c_str(), line.c_str());
+            return -1;
+        }
+
+        transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
+        routes[domain] = make_pair(target.substr(0, colon), port);
+    }
+
+    lock_guard<mutex> guard(transportLock);
+    transportMap.swap(routes);
+
+    return 0;
+}
+
+bool lookupTransport(string const &domain, string &host, int &port)
+{
+    string key = domain;
+    transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+    lock_guard<mutex> guard(transportLock);
+    auto found = transportMap.find(key);
+    if (found == transportMap.end()) {
+        return false;
+    }
+    host = found->second.first;
+    port = found->second.second;
+
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef __RELAY_HPP_
+#define __RELAY_HPP_
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <string>
+
+#include "async.hpp"
+
+using namespace std;
+
+// ************************************************************************
+// * Outbound SMTP client. attemptToRelay() finds where a recipient's mail
+// * goes and connects; relayMessage() does the dialogue from the greeting
+// * to QUIT, upgrading to TLS whenever the other side offers STARTTLS.
+// *
+// * Relays return RELAY_OK, the remote's reply code when it turned the
+// * message down (421, 451, 550, ...), or one of the failures below.
+// ************************************************************************
+const static int RELAY_OK = 0;
+const static int RELAY_FAILED = -1;      // no MX, or a reply that makes no sense
+const static int RELAY_UNREACHABLE = -2; // couldn't connect
+const static int RELAY_DEFERRED = -3;    // never tried, the domain's queue was full or too slow
+const static int RELAY_BROKEN = -4;      // the connection dropped, timed out or failed TLS halfway
+
+const static int SMTP_PORT = 25;
+
+// How long we wait on the remote, RFC 5321 4.5.3.2. The connect and
+// QUIT limits aren't in the RFC; a dead MX shouldn't hold a slot long.
+const static chrono::seconds RELAY_CONNECT_TIMEOUT{30};
+const static chrono::minutes RELAY_GREETING_TIMEOUT{5};
+const static chrono::minutes RELAY_COMMAND_TIMEOUT{5}; // EHLO, MAIL, RCPT
+const static chrono::minutes RELAY_DATA_INIT_TIMEOUT{2};
+const static chrono::minutes RELAY_DATA_BLOCK_TIMEOUT{3};
+const static chrono::minutes RELAY_DATA_END_TIMEOUT{10};
+const static chrono::seconds RELAY_TLS_TIMEOUT{60};
+const static chrono::seconds RELAY_QUIT_TIMEOUT{10};
+
+// Worth trying again later: 4xx from the remote, or we never got an answer
+inline bool relayTransient(int result)
+{
+    return (result >= 400 && result < 500) || result == RELAY_UNREACHABLE || result == RELAY_DEFERRED ||
+           result == RELAY_BROKEN;
+}
+
+Task<string> relayCommand(AsyncSocket &, string const &, chrono::milliseconds timeout, string *reply = nullptr);
+Task<void> quitRemote(AsyncSocket &);
+Task<int> relayMessage(AsyncSocket &, string const &peerName, string const &heloName, string const &reversePath,
+                       string const &forwardPath, string const &mailMessage);
+// Looks up the route (transport map, then MX), connects and relays,
+// introducing ourselves as heloName
+Task<int> attemptToRelay(string const &heloName, string const &reversePath, string const &forwardPath,
+                         string const &mailMessage);
+
+int getMxRecord(string const &, string &);
+int getHostAddress(string const &, struct sockaddr_in &);
+
+// ************************************************************************
+// * Transport map
+// *  Static routes that win over the MX lookup, one "domain host:port"
+// *  per line. Handy for smarthosts, and for pointing test domains at
+// *  sink MTAs on localhost.
+// ************************************************************************
+int reloadTransportMap(string const &path);
+bool lookupTransport(string const &domain, string &host, int &port);
+
+#endif
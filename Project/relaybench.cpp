@@ -0,0 +1,253 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "async.hpp"
+#include "delivery.hpp"
+#include "log.hpp"
+#include "relay.hpp"
+
+// ***************************************************************************
+// * relaybench
+// *  Starts one sink MTA per test domain on loopback. The fast ones accept
+// *  everything at once; slow.test takes a while over every message and
+// *  answers 421 to more than a few connections at a time, like a busy
+// *  provider would. Messages arrive at a steady rate, half of them for
+// *  slow.test, and are relayed once straight to the sink (what every
+// *  session used to do) and once through the delivery scheduler.
+// *
+// *  Both go through the server's own attemptToRelay(), routed to the
+// *  sinks by a transport map written for the run.
+// *
+// *  usage: relaybench [messages] [arrivals per second]
+// ***************************************************************************
+const static int DEFAULT_MESSAGES = 1000;
+const static int DEFAULT_ARRIVAL_RATE = 500;
+const static int MAX_SINK_LINE = 1024;
+const static int RESOLVER_THREADS = 4;
+// Outlives every relay: attemptToRelay() only holds on to a reference
+const static string BENCH_HELO = "relaybench";
+
+struct Sink {
+    char const *domain;
+    int delayMs;     // before answering the end of DATA
+    int maxSessions; // more than this get 421 at the greeting
+    int port;
+    atomic<int> sessions{0};
+    atomic<int> peak{0};
+    atomic<int> refused{0};
+};
+
+static Sink sinks[] = {
+    {"fast1.test", 0, 1000, 0}, {"fast2.test", 0, 1000, 0}, {"fast3.test", 0, 1000, 0}, {"slow.test", 100, 8, 0}};
+const static int SINK_COUNT = sizeof(sinks) / sizeof(sinks[0]);
+
+struct DomainStats {
+    int delivered = 0;
+    int deferred = 0;
+    int failed = 0;
+    vector<double> latencies; // ms, delivered messages only
+};
+
+static mutex statsLock;
+static DomainStats stats[SINK_COUNT];
+static atomic<int> messagesDone{0};
+
+static Task<void> sinkSession(Sink *sink, int fd)
+{
+    AsyncSocket sock(fd);
+    string line;
+
+    int sessions = ++sink->sessions;
+    int peak = sink->peak;
+    while (sessions > peak && !sink->peak.compare_exchange_weak(peak, sessions)) {
+    }
+
+    if (sessions > sink->maxSessions) {
+        sink->refused++;
+        co_await sock.writeAll("421 too many connections, try again later\r\n");
+        sink->sessions--;
+        co_return;
+    }
+
+    bool ok = co_await sock.writeAll("220 sink ready\r\n");
+    while (ok) {
+        ok = co_await sock.readLine(line, MAX_SINK_LINE);
+        if (!ok) {
+            break;
+        }
+        string verb = line.substr(0, 4);
+        if (verb == "DATA") {
+            co_await sock.writeAll("354 go ahead\r\n");
+            do {
+                ok = co_await sock.readLine(line, MAX_SINK_LINE);
+            } while (ok && line != ".");
+            co_await sleepFor(chrono::milliseconds(sink->delayMs));
+            co_await sock.writeAll("250 accepted\r\n");
+        }
+        else if (verb == "QUIT") {
+            co_await sock.writeAll("221 bye\r\n");
+            break;
+        }
+        else {
+            co_await sock.writeAll("250 ok\r\n");
+        }
+    }
+    sink->sessions--;
+}
+
+static Task<void> sendMessage(int index, bool scheduled, string const &message)
+{
+    // Every other message goes to the slow domain, the rest share out
+    int sinkIndex = index % 2 == 0 ? SINK_COUNT - 1 : (index / 2) % (SINK_COUNT - 1);
+    string reversePath = "bench@localhost";
+    string forwardPath = string("user@") + sinks[sinkIndex].domain;
+
+    auto start = chrono::steady_clock::now();
+    int result = 0;
+    if (scheduled) {
+        result = co_await deliveryScheduler.deliver(reversePath, forwardPath, message);
+    }
+    else {
+        result = co_await attemptToRelay(BENCH_HELO, reversePath, forwardPath, message);
+    }
+    double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    {
+        lock_guard<mutex> guard(statsLock);
+        DomainStats &domain = stats[sinkIndex];
+        if (result == RELAY_OK) {
+            domain.delivered++;
+            domain.latencies.push_back(latency);
+        }
+        else if (relayTransient(result)) {
+            domain.deferred++;
+        }
+        else {
+            domain.failed++;
+        }
+    }
+    messagesDone++;
+}
+
+static double percentile(vector<double> &values, double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    sort(values.begin(), values.end());
+    return values[min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static void runRound(char const *name, bool scheduled, int messages, int arrivalRate)
+{
+    string message(1024, 'x');
+    message += "\r\n";
+
+    for (int i = 0; i < SINK_COUNT; i++) {
+        stats[i] = DomainStats();
+        sinks[i].peak = 0;
+        sinks[i].refused = 0;
+    }
+    messagesDone = 0;
+
+    auto wallStart = chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++) {
+        this_thread::sleep_until(wallStart + chrono::microseconds(1000000LL * i / arrivalRate));
+        spawn(ioScheduler.next(), sendMessage(i, scheduled, message));
+    }
+    while (messagesDone < messages) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+
+    int delivered = 0;
+    printf("%s: %d msgs in %.2f s\n", name, messages, wall);
+    for (int i = 0; i < SINK_COUNT; i++) {
+        DomainStats &domain = stats[i];
+        printf("  %-10s delivered=%4d deferred=%4d failed=%3d  p50=%7.1f ms p99=%7.1f ms  peak_conns=%3d "
+               "refused=%4d\n",
+               sinks[i].domain, domain.delivered, domain.deferred, domain.failed, percentile(domain.latencies, 0.5),
+               percentile(domain.latencies, 0.99), sinks[i].peak.load(), sinks[i].refused.load());
+        delivered += domain.delivered;
+    }
+    printf("  delivered %d/%d, %.1f msgs/s\n", delivered, messages, delivered / wall);
+}
+
+int main(int argc, char **argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    int arrivalRate = argc > 2 ? atoi(argv[2]) : DEFAULT_ARRIVAL_RATE;
+    if (messages <= 0 || arrivalRate <= 0) {
+        fprintf(stderr, "usage %s [messages] [arrivals per second]\n", argv[0]);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setLogLevel(LOG_ERROR);
+    startLogger();
+
+    ioScheduler.start(thread::hardware_concurrency());
+
+    // One sink per domain, each on its own ephemeral loopback port
+    for (Sink &sink : sinks) {
+        int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        socklen_t addrLength = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = PF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, SOMAXCONN) < 0 ||
+            getsockname(listenfd, (struct sockaddr *)&addr, &addrLength) < 0) {
+            fprintf(stderr, "sink setup failed: %s\n", strerror(errno));
+            return -1;
+        }
+        sink.port = ntohs(addr.sin_port);
+
+        Sink *s = &sink;
+        thread([s, listenfd]() {
+            int connfd = -1;
+            while ((connfd = accept(listenfd, nullptr, nullptr)) >= 0) {
+                spawn(ioScheduler.next(), sinkSession(s, connfd));
+            }
+        }).detach();
+    }
+
+    // Route every test domain to its sink, the way an operator would
+    char transportPath[] = "/tmp/relaybench-transport-XXXXXX";
+    int transportfd = mkstemp(transportPath);
+    string routes;
+    for (Sink &sink : sinks) {
+        routes += string(sink.domain) + " 127.0.0.1:" + to_string(sink.port) + "\n";
+    }
+    if (transportfd < 0 || write(transportfd, routes.data(), routes.length()) != (ssize_t)routes.length() ||
+        reloadTransportMap(transportPath) < 0) {
+        fprintf(stderr, "transport map setup failed: %s\n", strerror(errno));
+        return -1;
+    }
+    close(transportfd);
+    unlink(transportPath);
+
+    blockingPool.start(RESOLVER_THREADS);
+    deliveryScheduler.start([](string const &reversePath, string const &forwardPath, string const &message) {
+        return attemptToRelay(BENCH_HELO, reversePath, forwardPath, message);
+    });
+
+    printf("%d messages at %d/s, half for slow.test (%d ms per message, at most %d connections)\n", messages,
+           arrivalRate, sinks[SINK_COUNT - 1].delayMs, sinks[SINK_COUNT - 1].maxSessions);
+    runRound("direct", false, messages, arrivalRate);
+    runRound("scheduled", true, messages, arrivalRate);
+
+    // The acceptors are still parked in accept(), skip the static teardown
+    deliveryScheduler.stop();
+    blockingPool.stop();
+    stopLogger();
+    fflush(stdout);
+    _exit(0);
+}
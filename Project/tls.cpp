@@ -0,0 +1,224 @@
+#include "tls.hpp"
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+
+const static int SERVER_SESSION_CACHE_SIZE = 20480;
+const static size_t CLIENT_SESSION_CACHE_SIZE = 1024;
+const static int TICKET_KEY_LENGTH = 80;
+const static long SELF_SIGNED_DAYS = 365;
+
+SSL_CTX *serverTlsContext = nullptr;
+SSL_CTX *clientTlsContext = nullptr;
+
+atomic<unsigned long> tlsFullHandshakes{0};
+atomic<unsigned long> tlsResumedHandshakes{0};
+
+// Last session per remote host, keyed by the name we sent as SNI
+static mutex clientSessionsLock;
+static unordered_map<string, SSL_SESSION *> clientSessions;
+static atomic<bool> clientSessionReuse{true};
+
+// ***************************************************************************
+// * useSelfSignedCertificate()
+// *  Without a configured certificate we still offer STARTTLS. Senders
+// *  doing opportunistic TLS don't verify us anyway, and encrypted beats
+// *  plaintext.
+// ***************************************************************************
+static int useSelfSignedCertificate(SSL_CTX *context)
+{
+    char hostname[256];
+    hostname[255] = '\0';
+    if (gethostname(hostname, 255) < 0) {
+        return -1;
+    }
+
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (key == nullptr || cert == nullptr) {
+        EVP_PKEY_free(key);
+        X509_free(cert);
+        return -1;
+    }
+
+    long serial = 0;
+    RAND_bytes((unsigned char *)&serial, sizeof(serial));
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial & 0x7fffffff);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), SELF_SIGNED_DAYS * 24 * 60 * 60);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *)hostname, -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    int result = -1;
+    if (X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(context, cert) == 1 &&
+        SSL_CTX_use_PrivateKey(context, key) == 1) {
+        result = 0;
+    }
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+
+    return result;
+}
+
+int initServerTls(string const &certPath, string const &keyPath, string const &ticketKeyPath)
+{
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    if (context == nullptr) {
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+
+    // Thousands of idle sessions shouldn't each pin 2 x 16k of buffers
+    SSL_CTX_set_mode(context, SSL_MODE_RELEASE_BUFFERS);
+
+    if (access(certPath.c_str(), R_OK) == 0) {
+        if (SSL_CTX_use_certificate_chain_file(context, certPath.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(context, keyPath.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(context) != 1) {
+            SSL_CTX_free(context);
+            return -1;
+        }
+    }
+    else if (useSelfSignedCertificate(context) < 0) {
+        SSL_CTX_free(context);
+        return -1;
+    }
+
+    // One cache for every session on every event loop, plus tickets (on by
+    // default) for clients that would rather hold the state themselves
+    static unsigned char const sessionContext[] = "smtp";
+    SSL_CTX_set_session_id_context(context, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(context, SERVER_SESSION_CACHE_SIZE);
+
+    // Shared ticket keys let a ticket from the old process work after an upgrade
+    ifstream ticketKeys(ticketKeyPath, ios_base::in | ios_base::binary);
+    if (ticketKeys) {
+        unsigned char keys[TICKET_KEY_LENGTH];
+        if (!ticketKeys.read((char *)keys, sizeof(keys)) ||
+            SSL_CTX_set_tlsext_ticket_keys(context, keys, sizeof(keys)) != 1) {
+            SSL_CTX_free(context);
+            return -1;
+        }
+    }
+
+    serverTlsContext = context;
+
+    return 0;
+}
+
+// OpenSSL hands us every new client session here, including TLS 1.3
+// tickets that arrive after the handshake. Returning 1 means we keep it.
+static int storeClientSession(SSL *ssl, SSL_SESSION *session)
+{
+    char const *peerName = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!clientSessionReuse || peerName == nullptr) {
+        return 0;
+    }
+
+    lock_guard<mutex> guard(clientSessionsLock);
+    auto found = clientSessions.find(peerName);
+    if (found != clientSessions.end()) {
+        SSL_SESSION_free(found->second);
+        found->second = session;
+        return 1;
+    }
+
+    if (clientSessions.size() >= CLIENT_SESSION_CACHE_SIZE) {
+        SSL_SESSION_free(clientSessions.begin()->second);
+        clientSessions.erase(clientSessions.begin());
+    }
+    clientSessions[peerName] = session;
+
+    return 1;
+}
+
+int initClientTls()
+{
+    SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+    if (context == nullptr) {
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_mode(context, SSL_MODE_RELEASE_BUFFERS);
+
+    // Opportunistic TLS, as MTAs do it: encrypt whenever the other side
+    // offers, without insisting on a certificate we could verify
+    SSL_CTX_set_verify(context, SSL_VERIFY_NONE, nullptr);
+
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context, storeClientSession);
+
+    clientTlsContext = context;
+
+    return 0;
+}
+
+void setClientSessionReuse(bool reuse)
+{
+    clientSessionReuse = reuse;
+    if (!reuse) {
+        lock_guard<mutex> guard(clientSessionsLock);
+        for (auto &cached : clientSessions) {
+            SSL_SESSION_free(cached.second);
+        }
+        clientSessions.clear();
+    }
+}
+
+SSL *newServerTls()
+{
+    SSL *ssl = SSL_new(serverTlsContext);
+    if (ssl != nullptr) {
+        SSL_set_accept_state(ssl);
+    }
+    return ssl;
+}
+
+SSL *newClientTls(string const &peerName)
+{
+    SSL *ssl = SSL_new(clientTlsContext);
+    if (ssl == nullptr) {
+        return nullptr;
+    }
+
+    SSL_set_connect_state(ssl);
+    SSL_set_tlsext_host_name(ssl, peerName.c_str());
+
+    if (clientSessionReuse) {
+        lock_guard<mutex> guard(clientSessionsLock);
+        auto found = clientSessions.find(peerName);
+        if (found != clientSessions.end()) {
+            SSL_set_session(ssl, found->second);
+        }
+    }
+
+    return ssl;
+}
+
+bool recordHandshake(SSL *ssl)
+{
+    bool resumed = SSL_session_reused(ssl) == 1;
+    if (resumed) {
+        tlsResumedHandshakes++;
+    }
+    else {
+        tlsFullHandshakes++;
+    }
+    return resumed;
+}
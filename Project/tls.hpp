@@ -0,0 +1,41 @@
+#ifndef __TLS_HPP_
+#define __TLS_HPP_
+
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+// ************************************************************************
+// * STARTTLS support
+// *  One SSL_CTX for each direction, shared by every session and relay.
+// *  The server context keeps OpenSSL's session cache and hands out
+// *  session tickets; the client context remembers the last session for
+// *  each remote host so the next connection there can resume instead of
+// *  doing a full handshake.
+// ************************************************************************
+extern SSL_CTX *serverTlsContext;
+extern SSL_CTX *clientTlsContext;
+
+extern atomic<unsigned long> tlsFullHandshakes;
+extern atomic<unsigned long> tlsResumedHandshakes;
+
+// Loads certPath/keyPath, or makes a throwaway self-signed certificate if
+// they don't exist. ticketKeyPath, if it exists, holds 80 bytes of ticket
+// keys so tickets survive a restart or upgrade. Returns -1 on failure.
+int initServerTls(string const &certPath, string const &keyPath, string const &ticketKeyPath);
+int initClientTls();
+
+// Turning this off makes every outbound handshake a full one (benchmarks)
+void setClientSessionReuse(bool reuse);
+
+// New connection objects, ready for AsyncSocket::startTls()
+SSL *newServerTls();
+SSL *newClientTls(string const &peerName);
+
+// Counts a finished handshake, returns true if it was resumed
+bool recordHandshake(SSL *ssl);
+
+#endif
@@ -0,0 +1,174 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "async.hpp"
+#include "log.hpp"
+#include "relay.hpp"
+#include "tls.hpp"
+
+// ***************************************************************************
+// * tlsbench
+// *  Relays messages through relayMessage() into a local SMTP sink that
+// *  offers STARTTLS, once with every handshake a full one and once with
+// *  client session reuse on, and reports handshakes per second and CPU
+// *  per message for each. The sink runs in this process too, so the CPU
+// *  figure covers both ends of every handshake.
+// *
+// *  usage: tlsbench [messages] [concurrency]
+// ***************************************************************************
+const static int DEFAULT_MESSAGES = 2000;
+const static int DEFAULT_CONCURRENCY = 16;
+const static int MAX_SINK_LINE = 1024;
+
+static Task<void> sinkSession(int fd)
+{
+    AsyncSocket sock(fd);
+    string line;
+
+    bool ok = co_await sock.writeAll("220 sink ready\r\n");
+    while (ok) {
+        ok = co_await sock.readLine(line, MAX_SINK_LINE);
+        if (!ok) {
+            break;
+        }
+        string verb = line.substr(0, line.find(' '));
+        transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+
+        if (verb == "EHLO") {
+            co_await sock.writeAll(sock.tls() == nullptr ? "250-sink\r\n250 STARTTLS\r\n" : "250 sink\r\n");
+        }
+        else if (verb == "STARTTLS") {
+            co_await sock.writeAll("220 go ahead\r\n");
+            ok = co_await sock.startTls(newServerTls());
+        }
+        else if (verb == "DATA") {
+            co_await sock.writeAll("354 go ahead\r\n");
+            do {
+                ok = co_await sock.readLine(line, MAX_SINK_LINE);
+            } while (ok && line != ".");
+            co_await sock.writeAll("250 accepted\r\n");
+        }
+        else if (verb == "QUIT") {
+            co_await sock.writeAll("221 bye\r\n");
+            co_return;
+        }
+        else {
+            co_await sock.writeAll("250 ok\r\n");
+        }
+    }
+}
+
+static Task<void> sendMessages(struct sockaddr_in addr, string const &message, atomic<int> &remaining,
+                               atomic<int> &failures, atomic<int> &workersDone)
+{
+    while (remaining.fetch_sub(1) > 0) {
+        AsyncSocket lfd(socket(PF_INET, SOCK_STREAM, 0));
+        int result = co_await lfd.connectTo((struct sockaddr *)&addr, sizeof(addr));
+        if (result == 0) {
+            result = co_await relayMessage(lfd, "localhost", "tlsbench", "bench@localhost", "sink@localhost", message);
+        }
+        if (result != 0) {
+            failures++;
+        }
+    }
+    workersDone++;
+}
+
+static double cpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void runRound(char const *name, bool resume, struct sockaddr_in addr, int messages, int concurrency)
+{
+    string message(1024, 'x');
+    message += "\r\n";
+
+    setClientSessionReuse(resume);
+    tlsFullHandshakes = 0;
+    tlsResumedHandshakes = 0;
+
+    atomic<int> remaining{messages};
+    atomic<int> failures{0};
+    atomic<int> workersDone{0};
+
+    double cpuStart = cpuSeconds();
+    auto wallStart = chrono::steady_clock::now();
+
+    for (int i = 0; i < concurrency; i++) {
+        spawn(ioScheduler.next(), sendMessages(addr, message, remaining, failures, workersDone));
+    }
+    while (workersDone < concurrency) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+    double cpu = cpuSeconds() - cpuStart;
+
+    printf("%-8s %6d msgs %6.2f s  %8.1f handshakes/s  %7.1f us CPU/msg  full=%lu resumed=%lu failed=%d\n", name,
+           messages, wall, messages / wall, cpu * 1e6 / messages, tlsFullHandshakes.load(),
+           tlsResumedHandshakes.load(), failures.load());
+}
+
+int main(int argc, char **argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    int concurrency = argc > 2 ? atoi(argv[2]) : DEFAULT_CONCURRENCY;
+    if (messages <= 0 || concurrency <= 0) {
+        fprintf(stderr, "usage %s [messages] [concurrency]\n", argv[0]);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setLogLevel(LOG_ERROR);
+    startLogger();
+
+    // Missing files mean a self-signed certificate and random ticket keys
+    if (initServerTls("/nonexistent", "/nonexistent", "/nonexistent") < 0 || initClientTls() < 0) {
+        fprintf(stderr, "TLS setup failed\n");
+        return -1;
+    }
+
+    // The sink listens on an ephemeral loopback port
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrLength = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, SOMAXCONN) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrLength) < 0) {
+        fprintf(stderr, "sink setup failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    ioScheduler.start(thread::hardware_concurrency());
+
+    thread acceptor([listenfd]() {
+        int connfd = -1;
+        while ((connfd = accept(listenfd, nullptr, nullptr)) >= 0) {
+            spawn(ioScheduler.next(), sinkSession(connfd));
+        }
+    });
+    acceptor.detach();
+
+    printf("%d messages, %d concurrent, sink on 127.0.0.1:%d, %s\n", messages, concurrency, ntohs(addr.sin_port),
+           OpenSSL_version(OPENSSL_VERSION));
+    runRound("full", false, addr, messages, concurrency);
+    runRound("resumed", true, addr, messages, concurrency);
+
+    // The acceptor is still parked in accept(), skip the static teardown
+    stopLogger();
+    fflush(stdout);
+    _exit(0);
+}
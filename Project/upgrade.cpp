@@ -0,0 +1,247 @@
+#include "upgrade.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+const static int MAX_LISTENERS = 16;
+const static int UPGRADE_ACK_TIMEOUT_MS = 10000;
+
+SessionTracker sessionTracker;
+
+// ***************************************************************************
+// * openUpgradeSocket()
+// *  Bind the Unix socket the next build will connect to. Any stale socket
+// *  file is replaced, which is also how a new process takes the path over
+// *  from the one it is replacing.
+// ***************************************************************************
+int openUpgradeSocket(string const &path)
+{
+    struct sockaddr_un addr;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    int fd = -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int sendListeners(int connfd, vector<int> const &listenfds)
+{
+    if (listenfds.empty() || listenfds.size() > MAX_LISTENERS) {
+        return -1;
+    }
+
+    // One byte of real data has to go along with the ancillary message
+    char count = (char)listenfds.size();
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * listenfds.size());
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listenfds.size());
+    memcpy(CMSG_DATA(cmsg), listenfds.data(), sizeof(int) * listenfds.size());
+
+    if (sendmsg(connfd, &msg, MSG_NOSIGNAL) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// ***************************************************************************
+// * takeOverListeners()
+// *  New-process side of the handoff. Returns the control connection, which
+// *  the caller writes UPGRADE_ACK to once it is accepting, or -1.
+// ***************************************************************************
+int takeOverListeners(string const &path, vector<int> &listenfds)
+{
+    struct sockaddr_un addr;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    int fd = -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char count = 0;
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int fds[MAX_LISTENERS];
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * received);
+        listenfds.insert(listenfds.end(), fds, fds + received);
+    }
+
+    if (listenfds.empty() || (int)listenfds.size() != count) {
+        for (int l : listenfds) {
+            close(l);
+        }
+        listenfds.clear();
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// ***************************************************************************
+// * handleUpgradeRequest()
+// *  Old-process side of the handoff. Returns true once the new process has
+// *  confirmed it is accepting, meaning we should stop. If it never does we
+// *  keep serving as if nothing happened.
+// ***************************************************************************
+bool handleUpgradeRequest(int upgradefd, vector<int> const &listenfds)
+{
+    int connfd = -1;
+    if ((connfd = accept(upgradefd, nullptr, nullptr)) < 0) {
+        return false;
+    }
+
+    if (sendListeners(connfd, listenfds) < 0) {
+        close(connfd);
+        return false;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = connfd;
+    pfd.events = POLLIN;
+
+    char ack = 0;
+    bool confirmed = poll(&pfd, 1, UPGRADE_ACK_TIMEOUT_MS) > 0 && read(connfd, &ack, 1) == 1 && ack == UPGRADE_ACK;
+    close(connfd);
+
+    return confirmed;
+}
+
+// ***************************************************************************
+// * SessionTracker
+// ***************************************************************************
+void SessionTracker::add(int sockfd)
+{
+    lock_guard<mutex> guard(lock);
+    sessions[sockfd] = false;
+}
+
+void SessionTracker::remove(int sockfd)
+{
+    lock_guard<mutex> guard(lock);
+    sessions.erase(sockfd);
+    if (sessions.empty()) {
+        emptied.notify_all();
+    }
+}
+
+bool SessionTracker::enterIdle(int sockfd, bool inTransaction)
+{
+    lock_guard<mutex> guard(lock);
+    if (isDraining && !inTransaction) {
+        return false;
+    }
+    sessions[sockfd] = !inTransaction;
+    return true;
+}
+
+void SessionTracker::leaveIdle(int sockfd)
+{
+    lock_guard<mutex> guard(lock);
+    sessions[sockfd] = false;
+}
+
+bool SessionTracker::draining()
+{
+    lock_guard<mutex> guard(lock);
+    return isDraining;
+}
+
+void SessionTracker::beginDrain()
+{
+    lock_guard<mutex> guard(lock);
+    isDraining = true;
+
+    // Idle sessions are blocked reading their next command. Shutting the
+    // read side wakes them up with EOF and they answer 421 on the way out.
+    // Sessions in the middle of a transaction are left to finish it.
+    for (auto &session : sessions) {
+        if (session.second) {
+            shutdown(session.first, SHUT_RD);
+        }
+    }
+}
+
+size_t SessionTracker::waitForDrain(chrono::seconds deadline)
+{
+    unique_lock<mutex> guard(lock);
+    if (emptied.wait_for(guard, deadline, [this]() { return sessions.empty(); })) {
+        return 0;
+    }
+
+    // Out of time, cut everything that is left
+    size_t remaining = sessions.size();
+    for (auto &session : sessions) {
+        shutdown(session.first, SHUT_RDWR);
+    }
+    emptied.wait_for(guard, chrono::seconds(1), [this]() { return sessions.empty(); });
+
+    return remaining;
+}
@@ -0,0 +1,59 @@
+#ifndef __UPGRADE_HPP_
+#define __UPGRADE_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// ************************************************************************
+// * Graceful upgrade
+// *  A new build is started with -u. It connects to the running server's
+// *  upgrade socket and gets the listening fd(s) back over SCM_RIGHTS, so
+// *  the kernel keeps queueing connections the whole time. Once the new
+// *  process says it is accepting, the old one stops calling accept() and
+// *  drains the sessions it still has.
+// ************************************************************************
+const static char UPGRADE_ACK = 'A';
+
+int openUpgradeSocket(string const &path);
+int sendListeners(int connfd, vector<int> const &listenfds);
+int takeOverListeners(string const &path, vector<int> &listenfds);
+bool handleUpgradeRequest(int upgradefd, vector<int> const &listenfds);
+
+// ************************************************************************
+// * SessionTracker knows every live inbound session so a draining server
+// * can tell when it is safe to exit, and can hurry along the ones that are
+// * just sitting idle between transactions.
+// ************************************************************************
+class SessionTracker {
+public:
+    void add(int sockfd);
+    void remove(int sockfd);
+
+    // Marks the session as waiting for its next command. Returns false if
+    // the server is draining and no transaction is open, in which case the
+    // session should say 421 and go.
+    bool enterIdle(int sockfd, bool inTransaction);
+    void leaveIdle(int sockfd);
+
+    bool draining();
+    void beginDrain();
+    // Waits until every session is gone or the deadline passes, then cuts
+    // off whatever is left. Returns the number of sessions that were cut.
+    size_t waitForDrain(chrono::seconds deadline);
+
+private:
+    mutex lock;
+    condition_variable emptied;
+    unordered_map<int, bool> sessions;
+    bool isDraining = false;
+};
+
+extern SessionTracker sessionTracker;
+
+#endif